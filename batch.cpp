@@ -0,0 +1,664 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <err.h>
+
+#include "fileio.h"
+#include "libdefs.h"
+#include "objdefs.h"
+
+#include "to_omf.h"
+
+/*
+
+Batch conversion.
+
+cc65-to-omf [-o dir] infile... converts every input to dir/name.omf (or
+.omflib), or next to the input without -o.  For thousands of small
+objects the time goes to open/read/close and the FinderInfo xattrs as
+much as to conversion, so:
+
+- inputs are read ahead of the converters, which parse them from memory.
+  On Linux, one reader thread batches the open, statx, read and close
+  calls through io_uring (raw system calls, no liburing); elsewhere, or
+  if io_uring isn't available, or with -u (whose digest checks read and
+  hash the input themselves), a small pool of reader threads does.
+- converter threads convert several inputs at once.  -v, -u digests and
+  errors are handled in input order, as if they were converted one at a
+  time.
+- writer threads write the outputs and set their file types.
+
+*/
+
+namespace {
+
+	const unsigned reader_count = 4;
+	const unsigned writer_count = 2;
+	// inputs read ahead of the converter, outputs queued behind it.
+	const unsigned prefetch_count = 64;
+	const size_t queued_bytes = 32 * 1024 * 1024;
+
+	void write_file(const std::string &path, const std::vector<uint8_t> &data, uint16_t file_type) {
+		FILE *f = fopen(path.c_str(), "wb");
+		if (!f) fatal("Unable to open %s", path.c_str());
+		WriteData(f, data.data(), data.size());
+		if (fclose(f) != 0) fatal("Unable to write %s", path.c_str());
+		set_prodos_file_type(path, file_type, 0x0000);
+	}
+
+	class writer_pool {
+	public:
+		writer_pool(unsigned n) {
+			for (unsigned i = 0; i < n; ++i)
+				threads.emplace_back([this](){ run(); });
+		}
+
+		~writer_pool() {
+			join();
+		}
+
+		// writes everything queued; a write error is rethrown here.
+		void finish() {
+			join();
+			errors.rethrow();
+		}
+
+		// blocks while too much is queued.
+		void push(const std::string &path, std::vector<uint8_t> &&data, uint16_t file_type) {
+			std::unique_lock<std::mutex> lock(mutex);
+			space.wait(lock, [&](){ return bytes < queued_bytes || jobs.empty(); });
+			bytes += data.size();
+			jobs.push_back({ path, std::move(data), file_type });
+			lock.unlock();
+			cv.notify_one();
+		}
+
+	private:
+		void join() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				done = true;
+			}
+			cv.notify_all();
+			for (auto &t : threads) t.join();
+			threads.clear();
+		}
+
+		struct job {
+			std::string path;
+			std::vector<uint8_t> data;
+			uint16_t file_type;
+		};
+
+		void run() {
+			for (;;) {
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&](){ return done || !jobs.empty(); });
+				if (jobs.empty()) return;
+				job j = std::move(jobs.front());
+				jobs.pop_front();
+				lock.unlock();
+
+				errors.run([&](){ write_file(j.path, j.data, j.file_type); });
+
+				lock.lock();
+				bytes -= j.data.size();
+				lock.unlock();
+				space.notify_one();
+			}
+		}
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::condition_variable space;
+		std::deque<job> jobs;
+		size_t bytes = 0;
+		bool done = false;
+		std::vector<std::thread> threads;
+		worker_errors errors;
+	};
+
+	writer_pool *Writer = nullptr;
+
+
+	struct input {
+		std::string path;
+		std::string out;
+		int type = -1;
+		int error = 0;
+		bool current = false; // -u and up to date.
+		bool ready = false; // read.
+		bool done = false; // converted (or failed).
+		std::vector<uint8_t> data;
+		std::exception_ptr failure;
+	};
+
+	int data_type(const std::vector<uint8_t> &data) {
+		if (data.size() < 4) return -1;
+		uint32_t magic = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+		if (magic == OBJ_MAGIC) return 0;
+		if (magic == LIB_MAGIC) return 1;
+		return -1;
+	}
+
+	// shared by the readers, the converters and run_batch().
+	struct batch {
+		std::vector<input> inputs;
+		const char *outdir = nullptr;
+		uint64_t options = 0;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		unsigned next_read = 0;
+		unsigned next_convert = 0;
+		unsigned finished = 0; // handled by run_batch, in order.
+		bool stop = false;
+
+		// the next input to read, once it's within prefetch_count of the
+		// last one finished.  false when there's nothing left (or if wait
+		// is false and it isn't within reach yet).
+		bool next_input(unsigned &i, bool wait) {
+			std::unique_lock<std::mutex> lock(mutex);
+			auto ok = [&](){
+				return stop || next_read >= inputs.size() || next_read < finished + prefetch_count;
+			};
+			if (wait) cv.wait(lock, ok);
+			else if (!ok()) return false;
+			if (stop || next_read >= inputs.size()) return false;
+			i = next_read++;
+			return true;
+		}
+
+		void loaded(input &in) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				in.ready = true;
+			}
+			cv.notify_all();
+		}
+	};
+
+	void load(input &in, const char *outdir, bool check, uint64_t options) {
+
+		FILE *f = fopen(in.path.c_str(), "rb");
+		if (!f) {
+			in.error = errno;
+			return;
+		}
+
+		// the magic number is enough to name the output, so -u can skip
+		// reading up to date inputs.
+		in.data.resize(4);
+		in.data.resize(fread(in.data.data(), 1, 4, f));
+		in.type = data_type(in.data);
+		if (in.type >= 0) {
+			in.out = output_name(in.path, in.type, outdir);
+			if (check && up_to_date(in.path, in.out, options)) {
+				in.current = true;
+				std::vector<uint8_t>().swap(in.data);
+				fclose(f);
+				return;
+			}
+		}
+
+		fseek(f, 0, SEEK_END);
+		long n = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		in.data.resize(n > 0 ? n : 0);
+		if (fread(in.data.data(), 1, in.data.size(), f) != in.data.size())
+			in.error = ferror(f) ? errno : EIO;
+		fclose(f);
+	}
+
+	// the thread pool reader.
+	void read_inputs(batch &b) {
+		unsigned i;
+		while (b.next_input(i, true)) {
+			load(b.inputs[i], b.outdir, flag_u, b.options);
+			b.loaded(b.inputs[i]);
+		}
+	}
+}
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+namespace {
+
+	// just enough io_uring: the rings are mapped once and sqes are
+	// queued in order, then submitted together.
+	class uring {
+	public:
+		~uring() {
+			if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+			if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+			if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+			if (fd >= 0) close(fd);
+		}
+
+		// false if io_uring (or one of the operations) isn't available --
+		// an old kernel, or a seccomp policy.
+		bool open(unsigned entries) {
+			io_uring_params p = {};
+			fd = syscall(__NR_io_uring_setup, entries, &p);
+			if (fd < 0) return false;
+
+			sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+			cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+			bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+			if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+
+			sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			if (sq_ptr == MAP_FAILED) return false;
+			cq_ptr = single ? sq_ptr : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			if (cq_ptr == MAP_FAILED) return false;
+			sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+			sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+			if (sqes == MAP_FAILED) return false;
+
+			char *sq = (char *)sq_ptr;
+			char *cq = (char *)cq_ptr;
+			sq_tail = (unsigned *)(sq + p.sq_off.tail);
+			sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+			sq_array = (unsigned *)(sq + p.sq_off.array);
+			cq_head = (unsigned *)(cq + p.cq_off.head);
+			cq_tail = (unsigned *)(cq + p.cq_off.tail);
+			cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+			cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+			tail = *sq_tail;
+
+			const unsigned ops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE };
+			std::vector<uint8_t> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+			auto probe = (io_uring_probe *)buffer.data();
+			if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+			for (unsigned op : ops) {
+				if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+			}
+			return true;
+		}
+
+		void openat(uint64_t data, const char *path) {
+			auto &e = sqe(IORING_OP_OPENAT, data);
+			e.fd = AT_FDCWD;
+			e.addr = (uintptr_t)path;
+			e.open_flags = O_RDONLY | O_CLOEXEC;
+		}
+
+		void statx(uint64_t data, const char *path, struct statx *stx) {
+			auto &e = sqe(IORING_OP_STATX, data);
+			e.fd = AT_FDCWD;
+			e.addr = (uintptr_t)path;
+			e.len = STATX_SIZE;
+			e.off = (uintptr_t)stx;
+		}
+
+		void read(uint64_t data, int file, void *buffer, unsigned n, uint64_t offset) {
+			auto &e = sqe(IORING_OP_READ, data);
+			e.fd = file;
+			e.addr = (uintptr_t)buffer;
+			e.len = n;
+			e.off = offset;
+		}
+
+		void close_file(uint64_t data, int file) {
+			auto &e = sqe(IORING_OP_CLOSE, data);
+			e.fd = file;
+		}
+
+		// submits what's queued and waits for a completion.
+		bool submit_and_wait() {
+			__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+			for (;;) {
+				long n = syscall(__NR_io_uring_enter, fd, queued, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+				if (n >= 0) {
+					queued -= n;
+					return true;
+				}
+				if (errno != EINTR) return false;
+			}
+		}
+
+		// f(data, result) for each completion.
+		template<class F>
+		void completions(F &&f) {
+			unsigned head = *cq_head;
+			unsigned end = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != end; ++head) {
+				const auto &c = cqes[head & cq_mask];
+				f(c.user_data, c.res);
+			}
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		}
+
+	private:
+		io_uring_sqe &sqe(unsigned op, uint64_t data) {
+			unsigned index = tail++ & sq_mask;
+			auto &e = sqes[index];
+			e = {};
+			e.opcode = op;
+			e.user_data = data;
+			sq_array[index] = index;
+			++queued;
+			return e;
+		}
+
+		int fd = -1;
+		void *sq_ptr = MAP_FAILED;
+		void *cq_ptr = MAP_FAILED;
+		io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+		size_t sq_size = 0;
+		size_t cq_size = 0;
+		size_t sqes_size = 0;
+		unsigned *sq_tail = nullptr;
+		unsigned *sq_array = nullptr;
+		unsigned *cq_head = nullptr;
+		unsigned *cq_tail = nullptr;
+		io_uring_cqe *cqes = nullptr;
+		unsigned sq_mask = 0;
+		unsigned cq_mask = 0;
+		unsigned tail = 0;
+		unsigned queued = 0;
+	};
+
+	// an input is opened and statx'd at once, then read (in pieces if the
+	// read comes up short) and closed; at most 2 operations per input are
+	// in flight, for at most prefetch_count inputs.
+	const unsigned ring_entries = 2 * prefetch_count;
+	enum { OP_OPEN, OP_STATX, OP_READ, OP_CLOSE };
+	const uint32_t max_read = 1 << 30;
+
+	// returns when every input has been read, or if the ring fails (the
+	// thread pool reader carries on).
+	void read_inputs(batch &b, uring &ring) {
+
+		struct state {
+			int fd = -1;
+			bool busy = false;
+			unsigned pending = 0;
+			size_t got = 0;
+			struct statx stx;
+		};
+		std::vector<state> states(b.inputs.size());
+		unsigned in_flight = 0;
+
+		auto close_input = [&](unsigned i){
+			if (states[i].fd >= 0) ring.close_file(i * 4 + OP_CLOSE, states[i].fd);
+			else {
+				auto &in = b.inputs[i];
+				in.type = data_type(in.data);
+				if (in.type >= 0) in.out = output_name(in.path, in.type, b.outdir);
+				states[i].busy = false;
+				b.loaded(in);
+				--in_flight;
+			}
+		};
+
+		auto read_more = [&](unsigned i){
+			auto &in = b.inputs[i];
+			auto &s = states[i];
+			size_t n = std::min<size_t>(in.data.size() - s.got, max_read);
+			ring.read(i * 4 + OP_READ, s.fd, in.data.data() + s.got, n, s.got);
+		};
+
+		for (;;) {
+			unsigned i;
+			while (b.next_input(i, in_flight == 0)) {
+				auto &in = b.inputs[i];
+				states[i].busy = true;
+				states[i].pending = 2;
+				ring.openat(i * 4 + OP_OPEN, in.path.c_str());
+				ring.statx(i * 4 + OP_STATX, in.path.c_str(), &states[i].stx);
+				++in_flight;
+			}
+			if (!in_flight) return;
+
+			// the rings are sized for everything in flight, so this
+			// shouldn't happen.  What's in flight fails; the thread pool
+			// reader reads the rest.
+			if (!ring.submit_and_wait()) {
+				int error = errno;
+				for (unsigned j = 0; j < b.inputs.size(); ++j) {
+					if (!states[j].busy) continue;
+					b.inputs[j].error = error;
+					b.loaded(b.inputs[j]);
+				}
+				return;
+			}
+
+			ring.completions([&](uint64_t data, int res){
+				unsigned i = data / 4;
+				auto &in = b.inputs[i];
+				auto &s = states[i];
+				switch (data % 4) {
+					case OP_OPEN:
+					case OP_STATX:
+						if (res < 0 && !in.error) in.error = -res;
+						else if (data % 4 == OP_OPEN && res >= 0) s.fd = res;
+						if (--s.pending) break;
+						if (in.error) {
+							close_input(i);
+							break;
+						}
+						in.data.resize(s.stx.stx_size);
+						if (in.data.empty()) close_input(i);
+						else read_more(i);
+						break;
+					case OP_READ:
+						// 0: the file got shorter.
+						if (res <= 0) {
+							in.error = res ? -res : EIO;
+							close_input(i);
+							break;
+						}
+						s.got += res;
+						if (s.got < in.data.size()) read_more(i);
+						else close_input(i);
+						break;
+					case OP_CLOSE:
+						s.fd = -1;
+						close_input(i);
+						break;
+				}
+			});
+		}
+	}
+}
+
+#endif
+
+namespace {
+
+	// in a converter thread.  Errors are thrown (flag_recover).
+	void convert_input(input &in) {
+
+		Outputs.clear();
+
+		if (in.error) {
+			errno = in.error;
+			fatal("Unable to open file %s", in.path.c_str());
+		}
+		if (in.type < 0) return;
+
+		if (in.current) {
+			Outputs.emplace_back(in.out);
+		} else {
+			FILE *f;
+		#if defined(_WIN32)
+			f = fopen(in.path.c_str(), "rb");
+		#else
+			f = fmemopen(in.data.data(), in.data.size(), "rb");
+		#endif
+			if (!f) fatal("Unable to open file %s", in.path.c_str());
+
+			close_on_error(f, [&](){ convert_file(f, in.path, in.out); });
+			fclose(f);
+		}
+
+		if (flag_md)
+			write_depfile(default_depfile(in.out), { in.path });
+	}
+
+	// converts inputs (in order, but several at once) until there are no
+	// more or run_batch() stops.
+	void convert_inputs(batch &b) {
+		for (;;) {
+			unsigned i;
+			{
+				std::unique_lock<std::mutex> lock(b.mutex);
+				if (b.stop || b.next_convert >= b.inputs.size()) return;
+				i = b.next_convert++;
+				b.cv.wait(lock, [&](){ return b.stop || b.inputs[i].ready; });
+				if (!b.inputs[i].ready) return;
+			}
+
+			auto &in = b.inputs[i];
+			try {
+				convert_input(in);
+			} catch (const fatal_error &) {
+				in.failure = std::current_exception();
+			}
+			std::vector<uint8_t>().swap(in.data);
+
+			{
+				std::lock_guard<std::mutex> lock(b.mutex);
+				in.done = true;
+			}
+			b.cv.notify_all();
+		}
+	}
+}
+
+
+// every output goes through here.  Batch mode hands it to the writer
+// threads; otherwise it's written immediately.
+void write_output(const std::string &path, std::vector<uint8_t> &&data, uint16_t file_type) {
+	Outputs.emplace_back(path);
+	if (Writer) Writer->push(path, std::move(data), file_type);
+	else write_file(path, data, file_type);
+}
+
+
+int run_batch(int argc, char **argv, const char *outdir, uint64_t options) {
+
+	batch b;
+	b.inputs.resize(argc);
+	for (int i = 0; i < argc; ++i)
+		b.inputs[i].path = argv[i];
+	b.outdir = outdir;
+	b.options = options;
+
+	// conversion errors are handled in input order, below.
+	bool recover = flag_recover;
+	flag_recover = true;
+
+	std::vector<std::thread> readers;
+#if defined(__linux__)
+	uring ring;
+	if (!flag_u && ring.open(ring_entries)) {
+		readers.emplace_back([&](){
+			read_inputs(b, ring);
+			read_inputs(b);
+		});
+	}
+#endif
+	if (readers.empty()) {
+		unsigned n = std::min<unsigned>(reader_count, b.inputs.size());
+		for (unsigned i = 0; i < n; ++i)
+			readers.emplace_back([&](){ read_inputs(b); });
+	}
+
+	int rv = 0;
+	std::vector<unsigned> digests;
+	std::exception_ptr error;
+	{
+		writer_pool writer(writer_count);
+		Writer = &writer;
+
+		// the member cache (--server) isn't shared between threads.
+		unsigned n = flag_cache ? 1 : std::max(1u, std::thread::hardware_concurrency());
+		n = std::min<unsigned>(n, b.inputs.size());
+		std::vector<std::thread> converters;
+		for (unsigned i = 0; i < n; ++i)
+			converters.emplace_back([&](){ convert_inputs(b); });
+
+		for (auto &in : b.inputs) {
+			{
+				std::unique_lock<std::mutex> lock(b.mutex);
+				b.cv.wait(lock, [&](){ return in.done; });
+			}
+
+			if (in.failure) {
+				error = in.failure;
+				break;
+			}
+
+			if (in.type < 0) {
+				warnx("Skipping %s: not a cc65 object or library", in.path.c_str());
+				rv = 1;
+			} else if (in.current) {
+				if (flag_v) printf("%s is up to date\n", in.out.c_str());
+			} else {
+				if (flag_v) printf("%s -> %s\n", in.path.c_str(), in.out.c_str());
+				if (flag_u) digests.push_back(&in - b.inputs.data());
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(b.mutex);
+				++b.finished;
+			}
+			b.cv.notify_all();
+		}
+
+		// stop the readers and converters (after an error).
+		{
+			std::lock_guard<std::mutex> lock(b.mutex);
+			b.stop = true;
+		}
+		b.cv.notify_all();
+		for (auto &t : converters) t.join();
+
+		// wait for the writers.
+		Writer = nullptr;
+		if (!error) {
+			try {
+				writer.finish();
+			} catch (const fatal_error &) {
+				error = std::current_exception();
+			}
+		}
+	}
+
+	for (auto &t : readers) t.join();
+
+	flag_recover = recover;
+	if (error) {
+		try {
+			std::rethrow_exception(error);
+		} catch (const fatal_error &e) {
+			fatal_exit(e.status);
+		}
+	}
+
+	// the digest lives on the output, so it's saved once that's written.
+	for (unsigned i : digests)
+		save_digest(b.inputs[i].path, b.inputs[i].out, options);
+
+	return rv;
+}
@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <stdio.h>
+
+#include <err.h>
+
+#include "to_omf.h"
+
+/*
+
+Pre-link check.
+
+--check file... reads the import and export tables of every object and
+library (in parallel) and resolves them the way the linker would:
+objects are always linked; library members are linked when they export
+something still undefined, searching the libraries in order until
+nothing changes.
+
+Reports undefined imports, duplicate exports and (with -v) the library
+member that satisfies each import.
+
+*/
+
+namespace {
+
+	struct definition {
+		unsigned input;
+		unsigned object;
+	};
+
+	// symbol -> definitions, sharded so readers rarely contend.
+	class symbol_table {
+	public:
+		void add(const std::string &name, definition d) {
+			auto &s = shards[std::hash<std::string>()(name) % shard_count];
+			std::lock_guard<std::mutex> lock(s.mutex);
+			s.map[name].push_back(d);
+		}
+
+		const std::vector<definition> *find(const std::string &name) const {
+			const auto &s = shards[std::hash<std::string>()(name) % shard_count];
+			auto iter = s.map.find(name);
+			return iter == s.map.end() ? nullptr : &iter->second;
+		}
+
+		// definitions are added in any order.
+		void sort() {
+			for (auto &s : shards) {
+				for (auto &kv : s.map) {
+					std::sort(kv.second.begin(), kv.second.end(), [](const definition &a, const definition &b){
+						return a.input != b.input ? a.input < b.input : a.object < b.object;
+					});
+				}
+			}
+		}
+
+	private:
+		static const unsigned shard_count = 64;
+
+		struct shard {
+			std::mutex mutex;
+			std::unordered_map<std::string, std::vector<definition>> map;
+		};
+		shard shards[shard_count];
+	};
+
+	struct input {
+		std::string path;
+		bool library = false;
+		std::vector<object_symbols> objects;
+	};
+
+	std::string object_name(const input &in, unsigned object) {
+		if (!in.library) return in.path;
+		return in.path + "(" + in.objects[object].member + ")";
+	}
+}
+
+int check_symbols(int argc, char **argv) {
+
+	std::vector<input> inputs(argc);
+	symbol_table table;
+
+	// 1. read the symbol tables.
+	std::atomic<unsigned> next(0);
+	worker_errors errors;
+	auto worker = [&](){
+		errors.run([&](){
+			for (unsigned i; (i = next++) < inputs.size(); ) {
+				auto &in = inputs[i];
+				in.path = argv[i];
+				in.library = file_type(in.path) == 1;
+				read_file_symbols(in.path, in.objects);
+
+				for (unsigned j = 0; j < in.objects.size(); ++j) {
+					for (const auto &e : in.objects[j].exports)
+						table.add(e.name, { i, j });
+				}
+			}
+		});
+	};
+
+	unsigned n = std::min<unsigned>(std::max(1u, std::thread::hardware_concurrency()), argc);
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < n; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (auto &t : threads) t.join();
+	errors.rethrow();
+
+	table.sort();
+
+	// 2. resolve.
+	std::vector<std::vector<bool>> linked(inputs.size());
+	std::vector<std::pair<unsigned, unsigned>> order;
+	for (unsigned i = 0; i < inputs.size(); ++i) {
+		linked[i].resize(inputs[i].objects.size(), false);
+		if (inputs[i].library) continue;
+		for (unsigned j = 0; j < inputs[i].objects.size(); ++j) {
+			linked[i][j] = true;
+			order.emplace_back(i, j);
+		}
+	}
+
+	auto is_linked = [&](const std::string &name) -> const definition * {
+		auto defs = table.find(name);
+		if (!defs) return nullptr;
+		for (const auto &d : *defs)
+			if (linked[d.input][d.object]) return &d;
+		return nullptr;
+	};
+
+	// library members providing an import: symbol -> member.
+	std::unordered_map<std::string, definition> from_library;
+
+	for (bool delta = true; delta; ) {
+		delta = false;
+		for (unsigned i = 0; i < inputs.size(); ++i) {
+			if (!inputs[i].library) continue;
+
+			// linked objects can grow as members are pulled in.
+			for (size_t k = 0; k < order.size(); ++k) {
+				auto o = order[k];
+				for (const auto &name : inputs[o.first].objects[o.second].imports) {
+					if (is_linked(name)) continue;
+					auto defs = table.find(name);
+					if (!defs) continue;
+					for (const auto &d : *defs) {
+						if (d.input != i) continue;
+						linked[d.input][d.object] = true;
+						order.emplace_back(d.input, d.object);
+						from_library.emplace(name, d);
+						delta = true;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	// 3. report.
+	int rv = 0;
+	std::unordered_set<std::string> seen;
+
+	for (auto o : order) {
+		const auto &os = inputs[o.first].objects[o.second];
+
+		for (const auto &e : os.exports) {
+			if (!seen.insert(e.name).second) continue;
+			auto defs = table.find(e.name);
+			std::vector<definition> dups;
+			for (const auto &d : *defs)
+				if (linked[d.input][d.object]) dups.push_back(d);
+			if (dups.size() < 2) continue;
+
+			fprintf(stderr, "duplicate: %s in", e.name.c_str());
+			for (const auto &d : dups)
+				fprintf(stderr, " %s", object_name(inputs[d.input], d.object).c_str());
+			fputc('\n', stderr);
+			rv = 1;
+		}
+	}
+
+	for (auto o : order) {
+		const auto &os = inputs[o.first].objects[o.second];
+		for (const auto &name : os.imports) {
+			if (is_linked(name)) continue;
+			fprintf(stderr, "undefined: %s (referenced by %s)\n",
+				name.c_str(), object_name(inputs[o.first], o.second).c_str());
+			rv = 1;
+		}
+	}
+
+	if (flag_v) {
+		std::vector<std::string> names;
+		for (const auto &kv : from_library) names.push_back(kv.first);
+		std::sort(names.begin(), names.end());
+		for (const auto &name : names) {
+			auto d = from_library[name];
+			printf("%s: %s\n", name.c_str(), object_name(inputs[d.input], d.object).c_str());
+		}
+	}
+
+	unsigned members = 0;
+	for (auto o : order)
+		if (inputs[o.first].library) ++members;
+	printf("%u object%s, %u library member%s linked%s\n",
+		(unsigned)(order.size() - members), order.size() - members == 1 ? "" : "s",
+		members, members == 1 ? "" : "s", rv ? "; errors found" : "");
+
+	return rv;
+}
@@ -0,0 +1,172 @@
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <err.h>
+
+#include "to_omf.h"
+
+/*
+
+Up-to-date check.
+
+After a conversion, the output file gets a digest xattr containing
+the input size, mtime, a hash of the input and a hash of the
+options that change the output (including the --resolve constants and
+--roots symbols, not just the file names) and the converter version.  On the next run, if the input size and mtime (or, failing
+that, the input hash) and the options match, the conversion is skipped.
+
+*/
+
+namespace {
+
+	const uint32_t digest_magic = 0x64353663; // 'c65d'
+	const uint32_t digest_version = 1;
+	// bump when the output for the same input and options changes, so -u
+	// reconverts.
+	const uint32_t converter_version = 2;
+
+	const uint64_t fnv_offset = 0xcbf29ce484222325ull;
+	const uint64_t fnv_prime = 0x00000100000001b3ull;
+
+	uint64_t fnv1a(uint64_t h, const void *data, size_t size) {
+		auto cp = static_cast<const uint8_t *>(data);
+		for (size_t i = 0; i < size; ++i) {
+			h ^= cp[i];
+			h *= fnv_prime;
+		}
+		return h;
+	}
+
+	struct digest_info {
+		uint64_t size = 0;
+		uint64_t mtime = 0;
+		uint64_t mtime_ns = 0;
+		uint64_t input = 0;
+		uint64_t options = 0;
+	};
+
+	void push_back_64(std::vector<uint8_t> &data, uint64_t x) {
+		push_back_32(data, x);
+		push_back_32(data, x >> 32);
+	}
+
+	uint64_t read_64(const uint8_t *cp) {
+		uint64_t x = 0;
+		for (int i = 7; i >= 0; --i) x = (x << 8) | cp[i];
+		return x;
+	}
+
+	bool stat_input(const std::string &path, digest_info &d) {
+		struct stat st;
+		if (stat(path.c_str(), &st) < 0) return false;
+
+		d.size = st.st_size;
+		d.mtime = st.st_mtime;
+	#if defined(__APPLE__)
+		d.mtime_ns = st.st_mtimespec.tv_nsec;
+	#elif defined(__linux__)
+		d.mtime_ns = st.st_mtim.tv_nsec;
+	#endif
+		return true;
+	}
+
+	bool hash_input(const std::string &path, uint64_t &h) {
+
+		uint8_t buffer[8192];
+
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f) return false;
+
+		h = fnv_offset;
+		for(;;) {
+			size_t n = fread(buffer, 1, sizeof(buffer), f);
+			if (n == 0) break;
+			h = fnv1a(h, buffer, n);
+		}
+		bool ok = !ferror(f);
+		fclose(f);
+		return ok;
+	}
+
+	bool load_digest(const std::string &outfile, digest_info &d) {
+
+		std::vector<uint8_t> data(64);
+
+		if (get_digest_info(outfile, data) < 0) return false;
+		if (data.size() != 8 + 5 * 8) return false;
+
+		uint32_t magic = read_64(data.data()) & 0xffffffff;
+		uint32_t version = read_64(data.data()) >> 32;
+		if (magic != digest_magic || version != digest_version) return false;
+
+		d.size = read_64(data.data() + 8);
+		d.mtime = read_64(data.data() + 16);
+		d.mtime_ns = read_64(data.data() + 24);
+		d.input = read_64(data.data() + 32);
+		d.options = read_64(data.data() + 40);
+		return true;
+	}
+
+	void store_digest(const std::string &outfile, const digest_info &d) {
+
+		std::vector<uint8_t> data;
+
+		push_back_32(data, digest_magic);
+		push_back_32(data, digest_version);
+		push_back_64(data, d.size);
+		push_back_64(data, d.mtime);
+		push_back_64(data, d.mtime_ns);
+		push_back_64(data, d.input);
+		push_back_64(data, d.options);
+
+		if (set_digest_info(outfile, data) < 0)
+			warnx("Unable to set digest on %s", outfile.c_str());
+	}
+
+}
+
+uint64_t hash_data(const void *data, size_t size) {
+	return fnv1a(fnv_offset, data, size);
+}
+
+uint64_t options_digest(const std::string &options) {
+
+	uint64_t h = fnv1a(fnv_offset, &converter_version, sizeof(converter_version));
+	return fnv1a(h, options.data(), options.size());
+}
+
+bool up_to_date(const std::string &infile, const std::string &outfile, uint64_t options) {
+
+	digest_info old;
+	digest_info d;
+
+	if (!load_digest(outfile, old)) return false;
+	if (old.options != options) return false;
+	if (!stat_input(infile, d)) return false;
+	if (d.size != old.size) return false;
+
+	if (d.mtime == old.mtime && d.mtime_ns == old.mtime_ns) return true;
+
+	// touched but possibly unchanged.
+	if (!hash_input(infile, d.input)) return false;
+	if (d.input != old.input) return false;
+
+	d.options = options;
+	store_digest(outfile, d);
+	return true;
+}
+
+void save_digest(const std::string &infile, const std::string &outfile, uint64_t options) {
+
+	digest_info d;
+
+	if (!stat_input(infile, d)) return;
+	if (!hash_input(infile, d.input)) return;
+	d.options = options;
+	store_digest(outfile, d);
+}
@@ -57,6 +57,63 @@ static bool is_sym_plus_literal(const expr_vector &ev, int ix) {
 	return false;
 }
 
+// constant folding, with ca65's (32-bit signed) semantics.
+static bool fold_unary(unsigned op, uint32_t x, uint32_t &rv) {
+	switch(op) {
+		case EXPR_UNARY_MINUS: rv = -x; return true;
+		case EXPR_NOT: rv = ~x; return true;
+		case EXPR_BOOLNOT: rv = x == 0; return true;
+		case EXPR_BYTE0: rv = x & 0xff; return true;
+		case EXPR_BYTE1: rv = (x >> 8) & 0xff; return true;
+		case EXPR_BYTE2: rv = (x >> 16) & 0xff; return true;
+		case EXPR_BYTE3: rv = (x >> 24) & 0xff; return true;
+		case EXPR_WORD0: rv = x & 0xffff; return true;
+		case EXPR_WORD1: rv = (x >> 16) & 0xffff; return true;
+		case EXPR_DWORD: rv = x; return true;
+		default: return false;
+	}
+}
+
+// shifts left (or right, if count is negative); 0 once everything is
+// shifted out.
+static uint32_t fold_shift(int32_t x, int64_t count) {
+	if (count >= 32 || count <= -32) return 0;
+	if (count >= 0) return (uint32_t)x << count;
+	return x >> -count;
+}
+
+static bool fold_binary(unsigned op, uint32_t a, uint32_t b, uint32_t &rv) {
+	int32_t sa = a;
+	int32_t sb = b;
+	switch(op) {
+		case EXPR_PLUS: rv = a + b; return true;
+		case EXPR_MINUS: rv = a - b; return true;
+		case EXPR_MUL: rv = a * b; return true;
+		case EXPR_DIV:
+			// INT32_MIN / -1 overflows (and traps).
+			if (sb == 0 || (sb == -1 && sa == INT32_MIN)) return false;
+			rv = sa / sb; return true;
+		case EXPR_MOD:
+			if (sb == 0 || (sb == -1 && sa == INT32_MIN)) return false;
+			rv = sa % sb; return true;
+		case EXPR_OR: rv = a | b; return true;
+		case EXPR_XOR: rv = a ^ b; return true;
+		case EXPR_AND: rv = a & b; return true;
+		case EXPR_SHL: rv = fold_shift(sa, sb); return true;
+		case EXPR_SHR: rv = fold_shift(sa, -(int64_t)sb); return true;
+		case EXPR_EQ: rv = sa == sb; return true;
+		case EXPR_NE: rv = sa != sb; return true;
+		case EXPR_LT: rv = sa < sb; return true;
+		case EXPR_GT: rv = sa > sb; return true;
+		case EXPR_LE: rv = sa <= sb; return true;
+		case EXPR_GE: rv = sa >= sb; return true;
+		case EXPR_BOOLAND: rv = sa && sb; return true;
+		case EXPR_BOOLOR: rv = sa || sb; return true;
+		case EXPR_BOOLXOR: rv = (sa != 0) != (sb != 0); return true;
+		default: return false;
+	}
+}
+
 static bool simplify_expression_helper(expr_vector &ev, int ix) {
 
 	auto &e = ev[ix];
@@ -78,7 +135,15 @@ static bool simplify_expression_helper(expr_vector &ev, int ix) {
 #endif
 
 	if ((e.op & EXPR_TYPEMASK) == EXPR_UNARYNODE) {
-		return simplify_expression_helper(ev, e.value);
+		bool delta = simplify_expression_helper(ev, e.value);
+
+		auto &ll = ev[e.value];
+		if (ll.op == EXPR_LITERAL && fold_unary(e.op, ll.value, e.value)) {
+			e.op = EXPR_LITERAL;
+			ll.op = EXPR_NULL;
+			delta = true;
+		}
+		return delta;
 	}
 
 	if ((e.op & EXPR_TYPEMASK) == EXPR_BINARYNODE) {
@@ -90,6 +155,17 @@ static bool simplify_expression_helper(expr_vector &ev, int ix) {
 		delta |= simplify_expression_helper(ev, l);
 		delta |= simplify_expression_helper(ev, r);
 
+		if (ev[l].op == EXPR_LITERAL && ev[r].op == EXPR_LITERAL) {
+			uint32_t value;
+			if (fold_binary(e.op, ev[l].value, ev[r].value, value)) {
+				e.op = EXPR_LITERAL;
+				e.value = value;
+				ev[l].op = EXPR_NULL;
+				ev[r].op = EXPR_NULL;
+				return true;
+			}
+		}
+
 		if (e.op == EXPR_PLUS) {
 
 			if (ev[l].op == EXPR_LITERAL) std::swap(l, r);
@@ -160,21 +236,31 @@ bool section_expr(const expr_vector &ev, int &seg, uint32_t &offset) {
 void read_expr_helper(FILE *f, expr_vector &rv) {
 
 	uint16_t op = Read8(f);
-	if (op == EXPR_NULL) errx(1, "Unexpected NULL expression");
+	if (op == EXPR_NULL) fatalx("Unexpected NULL expression");
 
 	if ((op & EXPR_TYPEMASK) == EXPR_LEAFNODE) {
 		switch(op) {
 			case EXPR_LITERAL:
 				rv.emplace_back( op, Read32(f));
 				break;
-			case EXPR_SYMBOL:
-				rv.emplace_back( op, ReadVar(f));
+			case EXPR_SYMBOL: {
+				unsigned nm = ReadVar(f);
+				// --resolve
+				if (!Constants.empty() && nm < Imports.size()) {
+					auto iter = Constants.find(Imports[nm].data());
+					if (iter != Constants.end()) {
+						rv.emplace_back(EXPR_LITERAL, iter->second);
+						break;
+					}
+				}
+				rv.emplace_back( op, nm);
 				break;
+			}
 			case EXPR_SECTION:
 				rv.emplace_back( op, ReadVar(f), 0);
 				break;
 			default:
-				errx(1,"Bad leaf node: $%02x", op);
+				fatalx("Bad leaf node: $%02x", op);
 		}
 		return;
 	}
@@ -188,7 +274,7 @@ void read_expr_helper(FILE *f, expr_vector &rv) {
 		
 		// right side.  should be null...
 		op = Read8(f);
-		if (op) errx(1, "Expected NULL for unary operation.");
+		if (op) fatalx("Expected NULL for unary operation.");
 		rv[ix].value = l;
 		return;
 	}
@@ -208,7 +294,8 @@ void read_expr_helper(FILE *f, expr_vector &rv) {
 
 expr_vector read_expr(FILE *f) {
 
-	expr_vector rv;
+	expr_vector rv(&MemberArena);
+	rv.reserve(8); // most expressions are small.
 	read_expr_helper(f, rv);
 	simplify_expression(rv);
 	return rv;
@@ -230,7 +317,23 @@ static void omf_mask(std::vector<uint8_t> &omf, uint32_t mask) {
 }
 
 
-static void convert_expression_helper(const expr_vector &ev, int ix, std::vector<uint8_t> &omf, unsigned size, unsigned segno) {
+// with --function-segments, a segment is split at its export offsets.
+// returns the piece containing offset, adjusting offset to be relative to it.
+static unsigned find_piece(const segment &seg, uint32_t &offset) {
+	if (seg.splits.empty() || (int32_t)offset < 0) return 0;
+
+	auto iter = std::upper_bound(seg.splits.begin(), seg.splits.end(), offset);
+	unsigned piece = iter - seg.splits.begin();
+	if (piece) offset -= seg.splits[piece - 1];
+	return piece;
+}
+
+std::string_view piece_name(const segment &seg, unsigned piece) {
+	if (!piece) return seg.name;
+	return intern(std::string(seg.name) + "~" + std::to_string(piece));
+}
+
+static void convert_expression_helper(const object_ref &obj, const expr_vector &ev, int ix, std::vector<uint8_t> &omf, unsigned size, unsigned segno, unsigned piece, bool &labels) {
 
 
 	const auto e = ev[ix];
@@ -246,25 +349,36 @@ static void convert_expression_helper(const expr_vector &ev, int ix, std::vector
 
 			case EXPR_SYMBOL:
 				push_back_8(omf, OMF_LAB);
-				push_back_string(omf, Imports[e.value]);
+				push_back_string(omf, obj.imports[e.value]);
 				return;
 
-			case EXPR_SECTION:
-				if (e.section == segno) {
+			case EXPR_SECTION: {
+				unsigned section = e.section;
+				uint32_t offset = e.value;
+				// --merge-segments
+				if (obj.segments[section].merged >= 0) {
+					offset += obj.segments[section].base;
+					section = obj.segments[section].merged;
+				}
+				unsigned p = find_piece(obj.segments[section], offset);
+				if (section == segno && p == piece) {
 					push_back_8(omf, OMF_REL);
-					push_back_32(omf, e.value);
+					push_back_32(omf, offset);
 				} else {
+					// private names -- see --dedup.
+					labels = true;
 					push_back_8(omf, OMF_LAB);
-					push_back_string(omf, Segments[e.section].name);
-					if (e.value) {
+					push_back_string(omf, piece_name(obj.segments[section], p));
+					if (offset) {
 						push_back_8(omf, OMF_ABS);
-						push_back_32(omf, e.value);
+						push_back_32(omf, offset);
 						push_back_8(omf, OMF_ADD);
 					}		
 				}
 				break;
+			}
 			default:
-				errx(1,"Bad leaf node: $%02x", op);
+				fatalx("Bad leaf node: $%02x", op);
 		}
 
 		return;
@@ -273,7 +387,7 @@ static void convert_expression_helper(const expr_vector &ev, int ix, std::vector
 	if ((op & EXPR_TYPEMASK) == EXPR_UNARYNODE) {
 		// unary
 
-		convert_expression_helper(ev, e.value, omf, size, segno);
+		convert_expression_helper(obj, ev, e.value, omf, size, segno, piece, labels);
 
 		switch(op) {
 			case EXPR_UNARY_MINUS:
@@ -357,7 +471,7 @@ static void convert_expression_helper(const expr_vector &ev, int ix, std::vector
 			case EXPR_FARADDR:
 			case EXPR_NEARADDR:
 			default:
-				errx(1,"Bad/unsupported unary node: $%02x", op);
+				fatalx("Bad/unsupported unary node: $%02x", op);
 		}
 		return;
 	}
@@ -367,8 +481,8 @@ static void convert_expression_helper(const expr_vector &ev, int ix, std::vector
 		int l = e.value >> 16;
 		int r = e.value & 0xffff;
 
-		convert_expression_helper(ev, l, omf, size, segno);
-		convert_expression_helper(ev, r, omf, size, segno);
+		convert_expression_helper(obj, ev, l, omf, size, segno, piece, labels);
+		convert_expression_helper(obj, ev, r, omf, size, segno, piece, labels);
 
 		switch(op) {
 			case EXPR_PLUS:
@@ -436,7 +550,7 @@ static void convert_expression_helper(const expr_vector &ev, int ix, std::vector
 			case EXPR_MAX:
 			case EXPR_MIN:
 			default:
-				errx(1,"Bad/unsupported binary node: $%02x", op);
+				fatalx("Bad/unsupported binary node: $%02x", op);
 		}
 		return;
 	}
@@ -461,7 +575,11 @@ static int expr_size(unsigned op) {
 	}
 }
 
-void convert_expression(const expr_vector &ev, unsigned size, std::vector<uint8_t> &omf, unsigned segno) {
+// returns true if another segment (or piece) is referenced by name.
+// obj is only read, so segments may be converted concurrently.
+bool convert_expression(const object_ref &obj, const expr_vector &ev, unsigned size, std::vector<uint8_t> &omf, unsigned segno, unsigned piece) {
+
+	bool labels = false;
 
 	// OMF relocations only support +/- and shift
 	// so special handling to zero-pad 1-byte (^<>) ops
@@ -475,7 +593,7 @@ void convert_expression(const expr_vector &ev, unsigned size, std::vector<uint8_
 	omf.push_back(0xeb);
 	omf.push_back(size);
 
-	convert_expression_helper(ev, 0, omf, size, segno);
+	convert_expression_helper(obj, ev, 0, omf, size, segno, piece, labels);
 
 	omf.push_back(0x00); // end of expr
 
@@ -484,11 +602,12 @@ void convert_expression(const expr_vector &ev, unsigned size, std::vector<uint8_
 		for (unsigned i = 0; i < zpad; ++i)
 			omf.push_back(0x00);
 	}
+	return labels;
 }
 
 
 
-void convert_gequ(const std::string &name, const expr_vector &ev, std::vector<uint8_t> &omf) {
+void convert_gequ(std::string_view name, const expr_vector &ev, std::vector<uint8_t> &omf) {
 
 	push_back_8(omf, 0xe7); // gequ
 	push_back_string(omf, name);
@@ -496,6 +615,7 @@ void convert_gequ(const std::string &name, const expr_vector &ev, std::vector<ui
 	push_back_8(omf, 'N'); // type
 	push_back_8(omf, 0); // public
 
-	convert_expression_helper(ev, 0, omf, 4, -1);
+	bool labels = false;
+	convert_expression_helper(object_ref{ Segments, Imports }, ev, 0, omf, 4, -1, 0, labels);
 	omf.push_back(0x00); // end of expr
 }
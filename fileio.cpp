@@ -38,6 +38,7 @@
 
 
 #include "fileio.h"
+#include "to_omf.h"
 
 
 
@@ -54,7 +55,7 @@ unsigned Read8 (FILE* F)
 {
     int C = getc (F);
     if (C == EOF) {
-        errx(1, "Read error (file corrupt?)");
+        fatalx("Read error (file corrupt?)");
     }
     return C;
 }
@@ -158,7 +159,7 @@ void* ReadData (FILE* F, void* Data, unsigned Size)
 /* Read data from the file */
 {
     if (fread (Data, 1, Size, F) != Size) {
-        errx(1, "Read error (file corrupt?)");
+        fatalx("Read error (file corrupt?)");
     }
     return Data;
 }
@@ -168,7 +169,7 @@ void Write8 (FILE* F, unsigned char Val)
 /* Write an 8 bit value to the file */
 {
     if (putc (Val, F) == EOF) {
-        errx(1, "Write error (disk full?)");
+        fatalx("Write error (disk full?)");
     }
 }
 
@@ -197,6 +198,6 @@ void WriteData (FILE* F, const void* Data, unsigned Size)
 /* Write data to the file */
 {
     if (fwrite (Data, 1, Size, F) != Size) {
-        errx (1, "Write error (disk full?)");
+        fatalx("Write error (disk full?)");
     }
 }
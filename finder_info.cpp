@@ -29,6 +29,7 @@
 #endif
 
 #include <string>
+#include <vector>
 #include <cstring>
 #include <cstdint>
 
@@ -180,3 +181,93 @@ int set_prodos_file_type(const std::string &path, uint16_t fileType, uint32_t au
 	return ok;
 }
 #endif
+
+/*
+ * converter digest, stored alongside the FinderInfo.
+ */
+
+#if defined(__linux__)
+#define XATTR_DIGEST_NAME "user.cc65-to-omf.digest"
+#else
+#define XATTR_DIGEST_NAME "cc65-to-omf.digest"
+#endif
+
+#if defined(AFP_WIN32)
+int set_digest_info(const std::string &path, const std::vector<uint8_t> &data) {
+
+	HANDLE h;
+	BOOL ok;
+
+	std::string xpath(path);
+	xpath += ":" XATTR_DIGEST_NAME;
+	h = CreateFileA(xpath.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (h == INVALID_HANDLE_VALUE) return -1;
+	ok = WriteFile(h, data.data(), data.size(), nullptr, nullptr);
+	CloseHandle(h);
+	return ok ? 0 : -1;
+}
+
+int get_digest_info(const std::string &path, std::vector<uint8_t> &data) {
+
+	HANDLE h;
+	BOOL ok;
+	DWORD n = 0;
+
+	std::string xpath(path);
+	xpath += ":" XATTR_DIGEST_NAME;
+	h = CreateFileA(xpath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (h == INVALID_HANDLE_VALUE) return -1;
+	ok = ReadFile(h, data.data(), data.size(), &n, nullptr);
+	CloseHandle(h);
+	if (!ok) return -1;
+	data.resize(n);
+	return 0;
+}
+#elif defined(__sun__)
+int set_digest_info(const std::string &path, const std::vector<uint8_t> &data) {
+	return -1;
+}
+
+int get_digest_info(const std::string &path, std::vector<uint8_t> &data) {
+	return -1;
+}
+#else
+int set_digest_info(const std::string &path, const std::vector<uint8_t> &data) {
+
+	int ok;
+
+#if defined(__APPLE__)
+	ok = setxattr(path.c_str(), XATTR_DIGEST_NAME, data.data(), data.size(), 0, 0);
+#elif defined(__linux__) 
+	ok = setxattr(path.c_str(), XATTR_DIGEST_NAME, data.data(), data.size(), 0);
+#elif defined(__FreeBSD__)
+	ok = extattr_set_file(path.c_str(), EXTATTR_NAMESPACE_USER, XATTR_DIGEST_NAME, data.data(), data.size()) == (ssize_t)data.size() ? 0 : -1;
+#elif defined(_AIX)
+	ok = setea(path.c_str(), XATTR_DIGEST_NAME, data.data(), data.size(), 0);
+#else
+	ok = -1;
+#endif
+	return ok;
+}
+
+// data should be sized to the maximum expected length; it is shrunk to fit.
+int get_digest_info(const std::string &path, std::vector<uint8_t> &data) {
+
+	ssize_t n;
+
+#if defined(__APPLE__)
+	n = getxattr(path.c_str(), XATTR_DIGEST_NAME, data.data(), data.size(), 0, 0);
+#elif defined(__linux__) 
+	n = getxattr(path.c_str(), XATTR_DIGEST_NAME, data.data(), data.size());
+#elif defined(__FreeBSD__)
+	n = extattr_get_file(path.c_str(), EXTATTR_NAMESPACE_USER, XATTR_DIGEST_NAME, data.data(), data.size());
+#elif defined(_AIX)
+	n = getea(path.c_str(), XATTR_DIGEST_NAME, data.data(), data.size());
+#else
+	n = -1;
+#endif
+	if (n < 0) return -1;
+	data.resize(n);
+	return 0;
+}
+#endif
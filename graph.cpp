@@ -0,0 +1,421 @@
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <err.h>
+
+#include "to_omf.h"
+
+/*
+
+Library member dependencies.
+
+Member A depends on member B if A imports a symbol B exports.  The IIgs
+linkers search a library's dictionary in order, one pass at a time, so
+a pass resolves everything if each member precedes the members it
+depends on.  Cycles (strongly connected components) are kept together.
+
+*/
+
+namespace {
+
+	struct tarjan {
+		const member_graph &graph;
+		std::vector<int> index;
+		std::vector<int> low;
+		std::vector<bool> on_stack;
+		std::vector<unsigned> stack;
+		std::vector<std::vector<unsigned>> components;
+		int next = 0;
+
+		tarjan(const member_graph &g) : graph(g),
+			index(g.size(), -1), low(g.size(), 0), on_stack(g.size(), false)
+		{}
+
+		// iterative, since a chain of members can be longer than the
+		// stack allows.
+		void visit(unsigned root) {
+			// vertex, next edge.
+			std::vector<std::pair<unsigned, unsigned>> work;
+
+			auto enter = [&](unsigned v) {
+				index[v] = low[v] = next++;
+				stack.push_back(v);
+				on_stack[v] = true;
+				work.emplace_back(v, 0);
+			};
+
+			enter(root);
+			while (!work.empty()) {
+				unsigned v = work.back().first;
+				unsigned &i = work.back().second;
+
+				if (i < graph[v].size()) {
+					unsigned w = graph[v][i++].to;
+					if (index[w] < 0) enter(w);
+					else if (on_stack[w]) low[v] = std::min(low[v], index[w]);
+					continue;
+				}
+
+				work.pop_back();
+				if (!work.empty()) {
+					unsigned u = work.back().first;
+					low[u] = std::min(low[u], low[v]);
+				}
+
+				if (low[v] == index[v]) {
+					std::vector<unsigned> c;
+					unsigned w;
+					do {
+						w = stack.back();
+						stack.pop_back();
+						on_stack[w] = false;
+						c.push_back(w);
+					} while (w != v);
+					std::sort(c.begin(), c.end());
+					components.emplace_back(std::move(c));
+				}
+			}
+		}
+	};
+
+	void json_string(FILE *f, std::string_view s) {
+		fputc('"', f);
+		for (unsigned char c : s) {
+			if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+			else if (c < 0x20) fprintf(f, "\\u%04x", c);
+			else fputc(c, f);
+		}
+		fputc('"', f);
+	}
+
+	void dot_string(FILE *f, std::string_view s) {
+		fputc('"', f);
+		for (char c : s) {
+			if (c == '"') fputc('\\', f);
+			fputc(c, f);
+		}
+		fputc('"', f);
+	}
+}
+
+// public symbol -> member.  The first definition wins, as with the
+// linker.  Keyed by interned name.
+static std::unordered_map<const char *, unsigned> member_exports(const std::vector<file> &files) {
+
+	std::unordered_map<const char *, unsigned> exports;
+	for (unsigned i = 0; i < files.size(); ++i) {
+		for (const auto &seg : files[i].segments) {
+			if (seg.omf.empty()) continue;
+			for (const auto &e : seg.exports)
+				if (!e.priv) exports.emplace(e.name.data(), i);
+		}
+	}
+	return exports;
+}
+
+void build_member_graph(const std::vector<file> &files, member_graph &graph) {
+
+	auto exports = member_exports(files);
+
+	graph.clear();
+	graph.resize(files.size());
+	for (unsigned i = 0; i < files.size(); ++i) {
+		std::map<unsigned, std::vector<std::string_view>> edges;
+		for (const auto &name : files[i].imports) {
+			auto iter = exports.find(name.data());
+			if (iter == exports.end() || iter->second == i) continue;
+			edges[iter->second].push_back(name);
+		}
+		for (auto &kv : edges) {
+			member_edge e;
+			e.to = kv.first;
+			e.symbols = std::move(kv.second);
+			graph[i].emplace_back(std::move(e));
+		}
+	}
+}
+
+// components are returned in reverse topological order
+// (a component follows everything it depends on).
+std::vector<std::vector<unsigned>> strongly_connected(const member_graph &graph) {
+
+	tarjan t(graph);
+	for (unsigned v = 0; v < graph.size(); ++v) {
+		if (t.index[v] < 0) t.visit(v);
+	}
+	return std::move(t.components);
+}
+
+void order_members(std::vector<file> &files) {
+
+	member_graph graph;
+	build_member_graph(files, graph);
+	auto components = strongly_connected(graph);
+
+	std::vector<file> tmp;
+	tmp.reserve(files.size());
+
+	// importers first.
+	for (auto iter = components.rbegin(); iter != components.rend(); ++iter) {
+		for (unsigned i : *iter)
+			tmp.emplace_back(std::move(files[i]));
+	}
+	files = std::move(tmp);
+
+	for (unsigned i = 0; i < files.size(); ++i)
+		files[i].number = i + 1;
+}
+
+void write_member_graph(const std::string &path, const std::vector<file> &files) {
+
+	member_graph graph;
+	build_member_graph(files, graph);
+	auto components = strongly_connected(graph);
+
+	bool json = path.size() > 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f) fatal("Unable to open %s", path.c_str());
+
+	if (json) {
+		fputs("{\n  \"members\": [\n", f);
+		for (unsigned i = 0; i < files.size(); ++i) {
+			fprintf(f, "    { \"file\": %u, \"name\": ", files[i].number);
+			json_string(f, files[i].name);
+			fputs(" }", f);
+			fputs(i + 1 < files.size() ? ",\n" : "\n", f);
+		}
+		fputs("  ],\n  \"edges\": [", f);
+		bool first = true;
+		for (unsigned i = 0; i < files.size(); ++i) {
+			for (const auto &e : graph[i]) {
+				fputs(first ? "\n" : ",\n", f);
+				fprintf(f, "    { \"from\": %u, \"to\": %u, \"backward\": %s, \"symbols\": [",
+					files[i].number, files[e.to].number, e.to < i ? "true" : "false");
+				for (unsigned j = 0; j < e.symbols.size(); ++j) {
+					if (j) fputs(", ", f);
+					json_string(f, e.symbols[j]);
+				}
+				fputs("] }", f);
+				first = false;
+			}
+		}
+		fputs(first ? "],\n" : "\n  ],\n", f);
+		fputs("  \"cycles\": [", f);
+		first = true;
+		for (const auto &c : components) {
+			if (c.size() < 2) continue;
+			fputs(first ? "\n    [" : ",\n    [", f);
+			for (unsigned j = 0; j < c.size(); ++j)
+				fprintf(f, j ? ", %u" : "%u", files[c[j]].number);
+			fputs("]", f);
+			first = false;
+		}
+		fputs(first ? "]\n}\n" : "\n  ]\n}\n", f);
+	} else {
+		fputs("digraph members {\n", f);
+		for (unsigned i = 0; i < files.size(); ++i) {
+			fprintf(f, "  m%u [label=", files[i].number);
+			dot_string(f, files[i].name);
+			fputs("];\n", f);
+		}
+		unsigned cluster = 0;
+		for (const auto &c : components) {
+			if (c.size() < 2) continue;
+			fprintf(f, "  subgraph cluster_%u {\n", ++cluster);
+			for (unsigned i : c)
+				fprintf(f, "    m%u;\n", files[i].number);
+			fputs("  }\n", f);
+		}
+		for (unsigned i = 0; i < files.size(); ++i) {
+			for (const auto &e : graph[i]) {
+				std::string label;
+				for (const auto &s : e.symbols) {
+					if (!label.empty()) label += "\\n";
+					label += s;
+				}
+				fprintf(f, "  m%u -> m%u [label=", files[i].number, files[e.to].number);
+				dot_string(f, label);
+				// backward references cost an extra linker pass.
+				if (e.to < i) fputs(", color=red", f);
+				fputs("];\n", f);
+			}
+		}
+		fputs("}\n", f);
+	}
+	fclose(f);
+}
+
+// bytes a member contributes to the library (segments, file name and
+// dictionary entries -- shared symbol names aren't counted).
+unsigned long member_size(const file &f) {
+	unsigned long n = 2 + 1 + f.name.size();
+	for (const auto &seg : f.segments) {
+		if (seg.omf.empty()) continue;
+		n += 48 + 10 + 1 + seg.name.size() + seg.omf.size();
+		n += 12 * (1 + seg.exports.size());
+	}
+	return n;
+}
+
+// keep only the members needed (transitively) by the root symbols.
+void shake_members(std::vector<file> &files, const std::vector<std::string> &roots) {
+
+	member_graph graph;
+	build_member_graph(files, graph);
+	auto exports = member_exports(files);
+
+	std::vector<bool> keep(files.size(), false);
+	std::vector<unsigned> work;
+
+	for (const auto &name : roots) {
+		auto iter = exports.find(intern(name).data());
+		if (iter == exports.end()) {
+			warnx("Root symbol %s is not exported by any member", name.c_str());
+			continue;
+		}
+		work.push_back(iter->second);
+	}
+
+	while (!work.empty()) {
+		unsigned v = work.back();
+		work.pop_back();
+		if (keep[v]) continue;
+		keep[v] = true;
+		for (const auto &e : graph[v])
+			if (!keep[e.to]) work.push_back(e.to);
+	}
+
+	std::vector<file> tmp;
+	unsigned long saved = 0;
+	unsigned dropped = 0;
+	for (unsigned i = 0; i < files.size(); ++i) {
+		if (keep[i]) {
+			tmp.emplace_back(std::move(files[i]));
+			continue;
+		}
+		unsigned long n = member_size(files[i]);
+		if (flag_v) printf("dropped %s (%lu bytes)\n", files[i].name.c_str(), n);
+		saved += n;
+		++dropped;
+	}
+	printf("%u of %u members dropped, %lu bytes saved\n",
+		dropped, (unsigned)files.size(), saved);
+
+	files = std::move(tmp);
+	for (unsigned i = 0; i < files.size(); ++i)
+		files[i].number = i + 1;
+}
+
+// split the members into libraries of at most max_members members and
+// (roughly) max_size bytes.  A cycle of members can't be resolved across
+// libraries in one pass, so each strongly connected component stays in
+// one library, and components are packed importers first, so a library
+// only imports from the libraries after it and they can be searched in
+// order.  Otherwise members keep their order.
+std::vector<std::vector<file>> partition_members(std::vector<file> &files, unsigned max_members, unsigned long max_size) {
+
+	member_graph graph;
+	build_member_graph(files, graph);
+	auto components = strongly_connected(graph);
+
+	// topological order, taking the component with the lowest member
+	// first (members are sorted within a component).
+	std::vector<unsigned> component(files.size());
+	for (unsigned c = 0; c < components.size(); ++c)
+		for (unsigned i : components[c]) component[i] = c;
+
+	std::vector<unsigned> importers(components.size(), 0);
+	std::vector<std::vector<unsigned>> exporters(components.size());
+	for (unsigned i = 0; i < files.size(); ++i) {
+		for (const auto &e : graph[i]) {
+			unsigned from = component[i];
+			unsigned to = component[e.to];
+			if (from == to) continue;
+			exporters[from].push_back(to);
+			++importers[to];
+		}
+	}
+
+	auto later = [&](unsigned a, unsigned b){
+		return components[a].front() > components[b].front();
+	};
+	std::priority_queue<unsigned, std::vector<unsigned>, decltype(later)> ready(later);
+	for (unsigned c = 0; c < components.size(); ++c)
+		if (!importers[c]) ready.push(c);
+
+	std::vector<unsigned> order;
+	order.reserve(components.size());
+	while (!ready.empty()) {
+		unsigned c = ready.top();
+		ready.pop();
+		order.push_back(c);
+		for (unsigned to : exporters[c])
+			if (!--importers[to]) ready.push(to);
+	}
+
+	std::vector<unsigned> part(files.size());
+	std::vector<std::vector<unsigned>> parts;
+	unsigned long size = 0;
+
+	for (unsigned ci : order) {
+		const auto &c = components[ci];
+		unsigned long n = 0;
+		for (unsigned i : c) n += member_size(files[i]);
+
+		// file numbers are 16-bit.
+		if (c.size() > 0xffff)
+			fatalx("%u mutually dependent members can't share a library", (unsigned)c.size());
+		if (c.size() > max_members || (max_size && n > max_size))
+			warnx("%u mutually dependent members (%s, ...) exceed the library limit",
+				(unsigned)c.size(), files[c.front()].name.c_str());
+
+		if (parts.empty() || parts.back().size() + c.size() > max_members
+			|| (max_size && size + n > max_size && !parts.back().empty())) {
+			parts.emplace_back();
+			size = 0;
+		}
+		for (unsigned i : c) {
+			part[i] = parts.size() - 1;
+			parts.back().push_back(i);
+		}
+		size += n;
+	}
+
+	unsigned crossing = 0;
+	for (unsigned i = 0; i < files.size(); ++i) {
+		for (const auto &e : graph[i]) {
+			if (part[e.to] == part[i]) continue;
+			crossing += e.symbols.size();
+			if (flag_v) {
+				for (const auto &name : e.symbols)
+					printf("%s (library %u) imports %.*s from %s (library %u)\n",
+						files[i].name.c_str(), part[i] + 1, (int)name.size(), name.data(),
+						files[e.to].name.c_str(), part[e.to] + 1);
+			}
+		}
+	}
+	if (crossing)
+		printf("%u import%s resolved by a later library\n", crossing, crossing == 1 ? "" : "s");
+
+	std::vector<std::vector<file>> rv;
+	rv.reserve(parts.size());
+	for (auto &p : parts) {
+		std::vector<file> tmp;
+		tmp.reserve(p.size());
+		for (unsigned i : p)
+			tmp.emplace_back(std::move(files[i]));
+		for (unsigned i = 0; i < tmp.size(); ++i)
+			tmp[i].number = i + 1;
+		rv.emplace_back(std::move(tmp));
+	}
+	files.clear();
+	return rv;
+}
@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <err.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "fileio.h"
+
+#include "to_omf.h"
+
+/*
+
+Library symbol index (lib.idx)
+
+Written next to a converted library with --symbol-index, so --find can
+locate a definition without opening the libraries.  Everything is
+little endian and fixed size; --find maps the file and binary searches
+it in place.
+
+header:
+	uint32_t magic ('c65x')
+	uint16_t version
+	uint16_t entry size
+	uint32_t entry count
+	uint32_t string offset (from start of file)
+entries, sorted by name:
+	uint32_t name (string offset)
+	uint32_t member (string offset)
+	uint32_t segment (string offset)
+	uint32_t offset in segment
+	uint16_t file number
+	uint16_t segment number
+strings:
+	pstring*
+
+*/
+
+namespace {
+
+	const uint32_t index_magic = 0x78353663; // 'c65x'
+	const uint16_t index_version = 1;
+	const unsigned header_size = 16;
+	const unsigned entry_size = 20;
+
+	uint32_t get_32(const uint8_t *cp) {
+		return cp[0] | (cp[1] << 8) | (cp[2] << 16) | ((uint32_t)cp[3] << 24);
+	}
+
+	uint16_t get_16(const uint8_t *cp) {
+		return cp[0] | (cp[1] << 8);
+	}
+
+	// compare a pstring with a string, bytewise.
+	int compare(const uint8_t *ps, const std::string &s) {
+		unsigned n = ps[0];
+		int rv = memcmp(ps + 1, s.data(), std::min<size_t>(n, s.size()));
+		if (rv) return rv;
+		if (n < s.size()) return -1;
+		if (n > s.size()) return 1;
+		return 0;
+	}
+
+	struct mapped_index {
+		const uint8_t *data = nullptr;
+		size_t size = 0;
+		uint32_t count = 0;
+		uint32_t strings = 0;
+
+		std::vector<uint8_t> buffer;
+
+		mapped_index() = default;
+		mapped_index(const mapped_index &) = delete;
+		mapped_index &operator=(const mapped_index &) = delete;
+		~mapped_index();
+
+		bool load(const std::string &path);
+		bool validate();
+
+		const uint8_t *entry(uint32_t i) const {
+			return data + header_size + i * entry_size;
+		}
+
+		// only the header is validated up front; nullptr if the string
+		// runs past the end of a truncated or corrupt index.
+		const uint8_t *pstring(uint32_t offset) const {
+			uint64_t start = (uint64_t)strings + offset;
+			if (start >= size || start + 1 + data[start] > size) return nullptr;
+			return data + start;
+		}
+
+		bool string(uint32_t offset, std::string &s) const {
+			const uint8_t *cp = pstring(offset);
+			if (!cp) return false;
+			s.assign(cp + 1, cp + 1 + cp[0]);
+			return true;
+		}
+	};
+
+#if defined(_WIN32)
+	mapped_index::~mapped_index() {
+	}
+
+	bool mapped_index::load(const std::string &path) {
+
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f) return false;
+
+		fseek(f, 0, SEEK_END);
+		long n = ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		buffer.resize(n);
+		bool ok = fread(buffer.data(), 1, n, f) == (size_t)n;
+		fclose(f);
+		if (!ok) return false;
+
+		data = buffer.data();
+		size = n;
+		return validate();
+	}
+#else
+	mapped_index::~mapped_index() {
+		if (data) munmap(const_cast<uint8_t *>(data), size);
+	}
+
+	bool mapped_index::load(const std::string &path) {
+
+		struct stat st;
+
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		if (fstat(fd, &st) < 0 || st.st_size == 0) {
+			close(fd);
+			return false;
+		}
+
+		void *vp = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (vp == MAP_FAILED) return false;
+
+		data = static_cast<const uint8_t *>(vp);
+		size = st.st_size;
+		return validate();
+	}
+#endif
+
+	bool mapped_index::validate() {
+
+		if (size < header_size) return false;
+		if (get_32(data) != index_magic) return false;
+		if (get_16(data + 4) != index_version) return false;
+		if (get_16(data + 6) != entry_size) return false;
+
+		count = get_32(data + 8);
+		strings = get_32(data + 12);
+		if (strings > size || header_size + (uint64_t)count * entry_size > strings) {
+			count = 0;
+			return false;
+		}
+		return true;
+	}
+}
+
+
+void write_symbol_index(const std::string &path, std::vector<index_entry> &entries) {
+
+	std::vector<uint8_t> data;
+	std::vector<uint8_t> strings;
+	std::unordered_map<std::string, uint32_t> string_map;
+
+	auto intern = [&](const std::string &s) -> uint32_t {
+		auto iter = string_map.find(s);
+		if (iter != string_map.end()) return iter->second;
+		uint32_t offset = strings.size();
+		push_back_string(strings, s);
+		string_map.emplace(s, offset);
+		return offset;
+	};
+
+	std::stable_sort(entries.begin(), entries.end(), [](const index_entry &a, const index_entry &b){
+		return a.name < b.name;
+	});
+
+	push_back_32(data, index_magic);
+	push_back_16(data, index_version);
+	push_back_16(data, entry_size);
+	push_back_32(data, entries.size());
+	push_back_32(data, header_size + entries.size() * entry_size);
+
+	for (const auto &e : entries) {
+		push_back_32(data, intern(e.name));
+		push_back_32(data, intern(e.member));
+		push_back_32(data, intern(e.segment));
+		push_back_32(data, e.offset);
+		push_back_16(data, e.file);
+		push_back_16(data, e.segno);
+	}
+
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f) fatal("Unable to open %s", path.c_str());
+	WriteData(f, data.data(), data.size());
+	WriteData(f, strings.data(), strings.size());
+	fclose(f);
+}
+
+
+// --find symbol lib...
+int find_symbols(const std::vector<std::string> &symbols, int argc, char **argv) {
+
+	std::vector<mapped_index> indexes(argc);
+	std::vector<std::string> names(argc);
+
+	// lib.idx or lib (.idx implied)
+	for (int i = 0; i < argc; ++i) {
+		std::string path = argv[i];
+		std::string name = path;
+		if (path.size() > 4 && path.compare(path.size() - 4, 4, ".idx") == 0)
+			name.resize(path.size() - 4);
+		else
+			path += ".idx";
+
+		if (!indexes[i].load(path))
+			warnx("%s: missing or invalid symbol index", path.c_str());
+		names[i] = std::move(name);
+	}
+
+	std::vector<bool> corrupt(argc, false);
+	auto bad_index = [&](int i) {
+		warnx("%s.idx: corrupt symbol index", names[i].c_str());
+		corrupt[i] = true;
+	};
+
+	int rv = 0;
+	for (const auto &sym : symbols) {
+		bool found = false;
+		for (int i = 0; i < argc; ++i) {
+			const auto &ix = indexes[i];
+			if (corrupt[i]) continue;
+
+			// lower bound
+			uint32_t lo = 0;
+			uint32_t hi = ix.count;
+			while (lo < hi) {
+				uint32_t mid = lo + (hi - lo) / 2;
+				const uint8_t *ps = ix.pstring(get_32(ix.entry(mid)));
+				if (!ps) break;
+				if (compare(ps, sym) < 0) lo = mid + 1;
+				else hi = mid;
+			}
+			if (lo < hi) {
+				bad_index(i);
+				continue;
+			}
+
+			for (; lo < ix.count; ++lo) {
+				const uint8_t *e = ix.entry(lo);
+				const uint8_t *ps = ix.pstring(get_32(e));
+				std::string member, segment;
+				if (!ps || !ix.string(get_32(e + 4), member) || !ix.string(get_32(e + 8), segment)) {
+					bad_index(i);
+					break;
+				}
+				if (compare(ps, sym)) break;
+
+				printf("%s: %s(%s) file %u, segment %u %s+$%04x\n",
+					sym.c_str(), names[i].c_str(),
+					member.c_str(), get_16(e + 16),
+					get_16(e + 18), segment.c_str(), get_32(e + 12));
+				found = true;
+			}
+		}
+		if (!found) {
+			warnx("%s: not found", sym.c_str());
+			rv = 1;
+		}
+	}
+	return rv;
+}
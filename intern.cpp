@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include <err.h>
+
+#include "to_omf.h"
+
+/*
+
+Interned names.
+
+Symbol and segment names are stored once per run, in an arena that is
+never freed, so the string_views handed out stay valid (across library
+members, the watch-mode member cache, ...).  Equal names have the same
+address, so maps can be keyed on the pointer instead of the text.
+
+*/
+
+namespace {
+
+	const size_t block_size = 64 * 1024;
+
+	std::mutex mutex;
+	std::unordered_set<std::string_view> names;
+	std::vector<std::unique_ptr<char[]>> blocks;
+	char *next = nullptr;
+	size_t remaining = 0;
+}
+
+std::string_view intern(std::string_view s) {
+
+	// an empty name would be stored at next without advancing it, sharing
+	// its address with the following name.
+	static const char empty[1] = "";
+	if (s.empty()) return std::string_view(empty, 0);
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto iter = names.find(s);
+	if (iter != names.end()) return *iter;
+
+	if (s.size() > remaining) {
+		size_t n = std::max(block_size, s.size());
+		blocks.emplace_back(new char[n]);
+		next = blocks.back().get();
+		remaining = n;
+	}
+
+	char *cp = next;
+	std::copy(s.begin(), s.end(), cp);
+	next += s.size();
+	remaining -= s.size();
+
+	std::string_view rv(cp, s.size());
+	names.insert(rv);
+	return rv;
+}
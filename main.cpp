@@ -1,11 +1,22 @@
 
 #include <algorithm>
+#include <atomic>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <err.h>
 
 #include "exprdefs.h"
@@ -22,7 +33,67 @@
 
 
 bool flag_v = false;
-const char *outfile = nullptr;
+bool flag_u = false;
+bool flag_md = false;
+bool flag_watch = false;
+bool flag_list = false;
+bool flag_check = false;
+bool flag_json = false;
+bool flag_index = false;
+bool flag_sort = false;
+bool flag_order = false;
+bool flag_function_segments = false;
+bool flag_merge_segments = false;
+bool flag_dedup = false;
+bool flag_shared_equates = false;
+bool flag_library = false;
+const char *graph_file = nullptr;
+const char *split_dir = nullptr;
+const char *update_lib = nullptr;
+unsigned max_members = 0;
+unsigned long max_lib_size = 0;
+std::vector<std::string> FindSymbols;
+std::vector<std::string> Roots;
+// --resolve name -> value, keyed by interned name.
+std::unordered_map<const char *, uint32_t> Constants;
+// the options that change the output, with what --resolve and --roots
+// read, for the -u digest and the member cache.  -v, -u, -o, -MD, ...
+// aren't included.
+std::string DigestOptions;
+// files the options read (--resolve, --roots @file), for -MD.
+std::vector<std::string> OptionInputs;
+// the input and output being converted, per thread (batch mode converts
+// several at once).
+thread_local const char *infile = nullptr;
+thread_local const char *outfile = nullptr;
+const char *depfile = nullptr;
+const char *server_path = nullptr;
+
+// every file written, for the dependency file.
+thread_local std::vector<std::string> Outputs;
+
+bool flag_recover = false;
+
+void fatal_exit(int status) {
+	if (flag_recover) throw fatal_error{ status };
+	exit(status);
+}
+
+void fatal(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vwarn(fmt, ap);
+	va_end(ap);
+	fatal_exit(1);
+}
+
+void fatalx(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vwarnx(fmt, ap);
+	va_end(ap);
+	fatal_exit(1);
+}
 
 /*
 
@@ -35,7 +106,7 @@ So, they need to be handled as inline GLOBAL entries.
 
 
 
-void push_back_global(std::vector<uint8_t> &data, const std::string &name, uint16_t length, uint8_t type, bool priv) {
+void push_back_global(std::vector<uint8_t> &data, std::string_view name, uint16_t length, uint8_t type, bool priv) {
 	data.push_back(0xe6); // global
 	push_back_string(data, name);
 	data.push_back(length);
@@ -45,7 +116,7 @@ void push_back_global(std::vector<uint8_t> &data, const std::string &name, uint1
 }
 
 
-void push_back_gequ(std::vector<uint8_t> &data, const std::string &name, uint16_t length, uint8_t type, bool priv, uint32_t value) {
+void push_back_gequ(std::vector<uint8_t> &data, std::string_view name, uint16_t length, uint8_t type, bool priv, uint32_t value) {
 
 	data.push_back(0xe7); // gequ
 	push_back_string(data, name);
@@ -63,25 +134,112 @@ void push_back_gequ(std::vector<uint8_t> &data, const std::string &name, uint16_
 }
 
 
-struct file {
-	unsigned number = 0;
-	std::string name;
+// the string pool, imports and fragment expressions only live while a
+// member is converted; they're allocated from MemberArena, which reset()
+// releases in one go.  Segments (and their OMF data and exports) outlive
+// the member and use the heap.  Literal segment data can be megabytes,
+// so it's a plain vector that reset() only clears.  All of it is per
+// thread, so members can be converted in parallel.  The arena's first
+// block is allocated on first use, so threads that never convert
+// anything (readers, writers) don't carry it.
+thread_local std::pmr::monotonic_buffer_resource MemberArena(256 * 1024);
+
+thread_local std::pmr::vector<std::string_view> StringPool(&MemberArena);
+thread_local std::pmr::vector<std::string_view> Imports(&MemberArena);
+thread_local std::vector<segment> Segments;
+thread_local std::vector<export_sym> Equates;
+thread_local std::vector<file> Files;
+
+// converted library members, keyed by options + library + member name
+// (--watch, --server).
+struct member_cache_entry {
+	uint64_t hash = 0;
+	unsigned long size = 0;
+	std::vector<std::string_view> imports;
 	std::vector<segment> segments;
+	std::vector<export_sym> equates;
+};
+
+bool flag_cache = false;
+uint64_t cache_options = 0;
+std::unordered_map<std::string, member_cache_entry> MemberCache;
+// a server sees any number of libraries.
+const size_t max_cached_members = 16384;
+
+// --server: each request starts from the server's own options.
+namespace {
+	auto option_refs() {
+		return std::tie(flag_v, flag_u, flag_md, flag_watch, flag_list, flag_check,
+			flag_json, flag_index, flag_sort, flag_order, flag_function_segments,
+			flag_merge_segments, flag_dedup, flag_shared_equates, flag_library,
+			graph_file, split_dir, update_lib, max_members, max_lib_size,
+			FindSymbols, Roots, Constants, DigestOptions, OptionInputs, infile, outfile, depfile, server_path,
+			flag_cache, cache_options);
+	}
+
+	template<class... T>
+	std::tuple<T...> option_values(const std::tuple<T &...> &refs) {
+		return refs;
+	}
+
+	decltype(option_values(option_refs())) SavedOptions;
+}
+
+void save_options() {
+	SavedOptions = option_refs();
+}
+
+void restore_options() {
+	option_refs() = SavedOptions;
+	Outputs.clear();
+	Files.clear();
+}
+
+// segment contents, parsed once by read_segments() and converted by
+// process_segments() once the exports are known.
+struct fragment {
+	unsigned type = 0;
+	unsigned long size = 0;
+	size_t data = 0; // FRAG_LITERAL: offset in SegmentData
+	expr_vector expr; // FRAG_EXPR, FRAG_SEXPR
+
+	fragment(unsigned t, unsigned long n, size_t d, expr_vector &&e) :
+		type(t), size(n), data(d), expr(std::move(e))
+	{}
 };
 
-std::vector<std::string> StringPool;
-std::vector<std::string> Imports;
-std::vector<segment> Segments;
-std::vector<file> Files;
+struct segment_body {
+	unsigned long pc = 0;
+	std::pmr::vector<fragment> fragments;
+
+	segment_body(unsigned long n) : pc(n), fragments(&MemberArena)
+	{}
+};
+
+thread_local std::pmr::vector<segment_body> SegmentBodies(&MemberArena);
+thread_local std::vector<uint8_t> SegmentData;
+
+// the converting thread's object, for segment workers.
+struct object_state {
+	std::vector<segment> &segments;
+	const std::pmr::vector<std::string_view> &imports;
+	const std::pmr::vector<segment_body> &bodies;
+	const std::vector<uint8_t> &data;
+};
 
 void reset() {
-	StringPool.clear();
-	Imports.clear();
+	// drop the arena storage before rewinding it.
+	std::pmr::vector<std::string_view>(&MemberArena).swap(StringPool);
+	std::pmr::vector<std::string_view>(&MemberArena).swap(Imports);
+	std::pmr::vector<segment_body>(&MemberArena).swap(SegmentBodies);
+	SegmentData.clear();
 	Segments.clear();
+	Equates.clear();
+	MemberArena.release();
 }
 
 
-long save_omf_segment(FILE *f, const segment &seg, int segno) {
+long save_omf_segment(std::vector<uint8_t> &data, const segment &seg, int segno) {
 
 	uint8_t header[48 + 10 + 1];
 
@@ -143,15 +301,15 @@ long save_omf_segment(FILE *f, const segment &seg, int segno) {
 	// seg name
 	header[58] = seg.name.size();
 
-	WriteData(f, header, sizeof(header));
-	WriteData(f, seg.name.data(), seg.name.size());
-	WriteData(f, seg.omf.data(), seg.omf.size());
+	data.insert(data.end(), header, header + sizeof(header));
+	data.insert(data.end(), seg.name.begin(), seg.name.end());
+	data.insert(data.end(), seg.omf.begin(), seg.omf.end());
 
 	return seg.omf.size() + sizeof(header) + seg.name.size();
 }
 
 
-long save_omf_lib_header(FILE *f, const std::vector<uint8_t> &a, const std::vector<uint8_t> &b, const std::vector<uint8_t> &c) {
+long save_omf_lib_header(std::vector<uint8_t> &data, const std::vector<uint8_t> &a, const std::vector<uint8_t> &b, const std::vector<uint8_t> &c) {
 
 	// sizeof("") includes trailing 0 byte.
 	uint8_t header[44 + 10 + sizeof("LIBRARY")];
@@ -208,21 +366,21 @@ long save_omf_lib_header(FILE *f, const std::vector<uint8_t> &a, const std::vect
 	// load name
 	for (int i = 0; i < 18; ++i) header[44 + i] = "          \x07LIBRARY"[i];
 
-	WriteData(f, header, sizeof(header));
+	data.insert(data.end(), header, header + sizeof(header));
 
-	Write8(f, 0xf2); // lconst
-	Write32(f,a.size());
-	WriteData(f, a.data(), a.size());
+	push_back_8(data, 0xf2); // lconst
+	push_back_32(data, a.size());
+	data.insert(data.end(), a.begin(), a.end());
 
-	Write8(f, 0xf2); // lconst
-	Write32(f,b.size());
-	WriteData(f, b.data(), b.size());
+	push_back_8(data, 0xf2); // lconst
+	push_back_32(data, b.size());
+	data.insert(data.end(), b.begin(), b.end());
 
-	Write8(f, 0xf2); // lconst
-	Write32(f,c.size());
-	WriteData(f, c.data(), c.size());
+	push_back_8(data, 0xf2); // lconst
+	push_back_32(data, c.size());
+	data.insert(data.end(), c.begin(), c.end());
 
-	Write8(f, 0x00); // end
+	push_back_8(data, 0x00); // end
 
 	return sizeof(header) + a.size() + b.size() + c.size() + 3 * 5 + 1;
 }
@@ -235,7 +393,7 @@ int file_type(FILE *f) {
 	if (magic == OBJ_MAGIC) return 0;
 	if (magic == LIB_MAGIC) return 1;
 
-	errx(1, "Unknown file type.");
+	fatalx("Unknown file type.");
 	return -1;
 }
 
@@ -247,6 +405,9 @@ void skip_info_list(FILE *f) {
 	}
 }
 
+// the pool is copied to MemberArena.  Most of it (file, scope and debug
+// names) isn't needed past the member; only the names that are kept
+// (imports, exports, segments) are interned.
 void read_strings(FILE *f, long size) {
 
 	unsigned count = ReadVar(f);
@@ -254,7 +415,9 @@ void read_strings(FILE *f, long size) {
 	StringPool.reserve(count);
 	for (unsigned i = 0; i < count; ++i) {
 		std::string s = ReadString(f);
-		StringPool.emplace_back(std::move(s));
+		char *cp = static_cast<char *>(MemberArena.allocate(s.size(), 1));
+		std::copy(s.begin(), s.end(), cp);
+		StringPool.emplace_back(cp, s.size());
 	}
 }
 
@@ -266,13 +429,14 @@ void read_imports(FILE *f, long size) {
 	for (unsigned i = 0; i < count; ++i) {
 		unsigned as = Read8(f); // address size. 
 		unsigned nm = ReadVar(f); // string index.
-		Imports.push_back(StringPool[nm]);
+		Imports.push_back(intern(StringPool[nm]));
 		skip_info_list(f);
 		skip_info_list(f);
 	}
 }
 
-void read_exports(FILE *f, long size) {
+// literal exports are moved to Equates if hoist is set (--shared-equates).
+void read_exports(FILE *f, long size, bool hoist) {
 
 	unsigned count = ReadVar(f);
 
@@ -282,19 +446,21 @@ void read_exports(FILE *f, long size) {
 
 		unsigned type = ReadVar(f);
 		if (type & 0x07) {
-			errx(1,"Constructor/Destructor not yet supported.");
+			fatalx("Constructor/Destructor not yet supported.");
 		}
 		unsigned as = Read8(f);
 		unsigned nm = ReadVar(f);
 
 		export_sym ex;
-		ex.name = StringPool[nm];
+		ex.name = intern(StringPool[nm]);
 
 		if (type & SYM_EXPR) {
-			ex.expr = read_expr(f);
-			if (section_expr(ex.expr, ex.section, ex.offset)) {
+			auto ev = read_expr(f);
+			if (section_expr(ev, ex.section, ex.offset)) {
 				ex.sectional = true;
-				ex.expr.clear();
+			} else {
+				// copied to the heap -- exports outlive the member.
+				ex.expr.assign(ev.begin(), ev.end());
 			}
 		} else {
 			uint32_t value = Read32(f);
@@ -311,6 +477,8 @@ void read_exports(FILE *f, long size) {
 
 		if (ex.sectional) {
 			Segments[ex.section].exports.emplace_back(std::move(ex));
+		} else if (hoist && ex.expr.size() == 1 && ex.expr.front().op == EXPR_LITERAL) {
+			Equates.emplace_back(std::move(ex));
 		} else{
 			global_exports.emplace_back(std::move(ex));
 		}
@@ -325,10 +493,12 @@ void read_exports(FILE *f, long size) {
 
 	if (!global_exports.empty()) {
 		segment s;
-		s.name = "GLOBALS";
+		s.name = intern("GLOBALS");
 
 		for (const auto &e : global_exports) {
 			convert_gequ(e.name, e.expr, s.omf);
+			for (const auto &n : e.expr)
+				if (n.op == EXPR_SECTION) s.section_labels = true;
 		}
 		s.omf.push_back(0x00); // end!
 		s.exports = std::move(global_exports);
@@ -336,6 +506,254 @@ void read_exports(FILE *f, long size) {
 	}
 }
 
+// --function-segments
+//
+// a segment is only split where it can be shown to be safe: at the start
+// of a .proc (from the scope and span tables ca65 writes with -g) that
+// nothing falls through into, that no instruction runs across and that
+// no branch, brl or per crosses.  the code is decoded from the segment
+// start, each export and each .proc.
+
+struct proc_start {
+	std::string_view name;
+	unsigned section;
+	uint32_t offset;
+};
+
+void read_procs(FILE *f, long base, const ObjHeader &h, std::vector<proc_start> &procs) {
+
+	struct span { unsigned section; uint32_t offset; };
+	std::vector<span> spans;
+
+	if (h.SpanSize) {
+		fseek(f, base + h.SpanOffs, SEEK_SET);
+		unsigned count = ReadVar(f);
+		spans.reserve(count);
+		for (unsigned i = 0; i < count; ++i) {
+			unsigned section = ReadVar(f);
+			uint32_t offset = ReadVar(f);
+			ReadVar(f); // size
+			ReadVar(f); // type
+			spans.push_back({ section, offset });
+		}
+	}
+
+	if (!h.ScopeSize) return;
+
+	fseek(f, base + h.ScopeOffs, SEEK_SET);
+	unsigned count = ReadVar(f);
+	for (unsigned i = 0; i < count; ++i) {
+		ReadVar(f); // parent
+		ReadVar(f); // lexical level
+		unsigned flags = ReadVar(f);
+		unsigned type = ReadVar(f);
+		unsigned nm = ReadVar(f);
+		if (flags & 0x01) ReadVar(f); // size
+		if (flags & 0x02) ReadVar(f); // label
+		unsigned n = ReadVar(f);
+
+		// .proc: a labeled scope.  it starts at its lowest span in each
+		// section.
+		bool proc = type == 2 && (flags & 0x02) && nm < StringPool.size();
+		size_t first = procs.size();
+		for (unsigned j = 0; j < n; ++j) {
+			unsigned id = ReadVar(f);
+			if (!proc || id >= spans.size()) continue;
+			const auto &sp = spans[id];
+			auto iter = std::find_if(procs.begin() + first, procs.end(), [&](const proc_start &p){
+				return p.section == sp.section;
+			});
+			if (iter == procs.end()) procs.push_back({ StringPool[nm], sp.section, sp.offset });
+			else if (sp.offset < iter->offset) iter->offset = sp.offset;
+		}
+	}
+}
+
+// 65816 instruction sizes, with 8-bit immediates.
+static const uint8_t opcode_size[256] = {
+	2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 4, // 0x
+	2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 4, // 1x
+	3, 2, 4, 2, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 4, // 2x
+	2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 4, // 3x
+	1, 2, 2, 2, 3, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 4, // 4x
+	2, 2, 2, 2, 3, 2, 2, 2, 1, 3, 1, 1, 4, 3, 3, 4, // 5x
+	1, 2, 3, 2, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 4, // 6x
+	2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 4, // 7x
+	2, 2, 3, 2, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 4, // 8x
+	2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 4, // 9x
+	2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 4, // Ax
+	2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 4, // Bx
+	2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 4, // Cx
+	2, 2, 2, 2, 2, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 4, // Dx
+	2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 1, 3, 3, 3, 4, // Ex
+	2, 2, 2, 2, 3, 2, 2, 2, 1, 3, 1, 1, 3, 3, 3, 4, // Fx
+};
+
+enum {
+	SPLIT_INSIDE = 1, // an instruction runs across it.
+	SPLIT_FALLS = 2, // an instruction falls through into it.
+	SPLIT_CROSSED = 4, // a branch, brl or per crosses it.
+};
+
+static const char *split_reason(unsigned unsafe) {
+	if (unsafe & SPLIT_INSIDE) return "an instruction runs across it";
+	if (unsafe & SPLIT_FALLS) return "code may fall through into it";
+	return "a branch crosses it";
+}
+
+// unsafe[offset]: SPLIT_xxx bits for each offset in the segment.
+static void decode_code(const segment_body &body, const std::vector<uint32_t> &entries, std::vector<uint8_t> &unsafe) {
+
+	unsigned long size = body.pc;
+
+	// -1: not a literal byte (an expression or fill).
+	std::vector<int> bytes(size, -1);
+	// the size of the fragment at each offset, negative if it isn't literal.
+	std::vector<long> frags(size + 1, 0);
+	unsigned long offset = 0;
+	for (const auto &frag : body.fragments) {
+		if (offset >= size) break;
+		bool literal = (frag.type & FRAG_TYPEMASK) == FRAG_LITERAL;
+		if (literal) {
+			for (unsigned long i = 0; i < frag.size; ++i)
+				bytes[offset + i] = SegmentData[frag.data + i];
+		}
+		frags[offset] = literal ? (long)frag.size : -(long)frag.size;
+		offset += frag.size;
+	}
+
+	unsafe.assign(size + 1, 0);
+	std::vector<int> crossed(size + 2, 0); // difference array.
+
+	std::vector<bool> seen(size);
+	std::vector<unsigned long> work(entries.begin(), entries.end());
+
+	while (!work.empty()) {
+		unsigned long pc = work.back();
+		work.pop_back();
+		if (pc >= size || bytes[pc] < 0 || seen[pc]) continue;
+		seen[pc] = true;
+
+		auto operand = [&](unsigned i){ return pc + i < size ? bytes[pc + i] : -1; };
+		unsigned op = bytes[pc];
+		unsigned lo = opcode_size[op];
+		unsigned hi = lo;
+		switch (op) {
+			case 0x09: case 0x29: case 0x49: case 0x69: // ora/and/eor/adc #
+			case 0x89: case 0xa9: case 0xc9: case 0xe9: // bit/lda/cmp/sbc #
+			case 0xa0: case 0xa2: case 0xc0: case 0xe0: { // ldy/ldx/cpy/cpx #
+				// 8 or 16 bits -- ca65 emits each instruction as a fragment
+				// (or an opcode and an expression), so that says which.
+				long n = frags[pc];
+				if (n == 1 && frags[pc + 1] < 0) n -= frags[pc + 1];
+				if (n == 2 || n == 3) lo = hi = n;
+				else hi = 3;
+				break;
+			}
+		}
+
+		bool transfer = false;
+		long target = -1;
+		switch (op) {
+			case 0x40: case 0x60: case 0x6b: // rti, rts, rtl
+			case 0x4c: case 0x5c: case 0x6c: case 0x7c: case 0xdc: // jmp, jml
+				transfer = true;
+				break;
+			case 0x80: // bra
+				transfer = true;
+				// fall through
+			case 0x10: case 0x30: case 0x50: case 0x70: // bpl, bmi, bvc, bvs
+			case 0x90: case 0xb0: case 0xd0: case 0xf0: // bcc, bcs, bne, beq
+				if (operand(1) >= 0) target = pc + 2 + (int8_t)operand(1);
+				break;
+			case 0x82: // brl
+				transfer = true;
+				// fall through
+			case 0x62: // per
+				if (operand(1) >= 0 && operand(2) >= 0)
+					target = pc + 3 + (int16_t)(operand(1) | operand(2) << 8);
+				break;
+		}
+
+		// an operand that isn't literal (a relocated expression) doesn't
+		// depend on where the pieces end up.
+		if (target >= 0) {
+			unsigned long a = std::min<unsigned long>(pc, target) + 1;
+			unsigned long b = std::min<unsigned long>(std::max<unsigned long>(pc, target), size);
+			if (a <= b) {
+				crossed[a]++;
+				crossed[b + 1]--;
+			}
+			if (op != 0x62) work.push_back(target);
+		}
+
+		for (unsigned n = lo; n <= hi; ++n) {
+			for (unsigned i = 1; i < n && pc + i <= size; ++i)
+				unsafe[pc + i] |= SPLIT_INSIDE;
+			if (transfer || pc + n > size) continue;
+			unsafe[pc + n] |= SPLIT_FALLS;
+			work.push_back(pc + n);
+		}
+	}
+
+	int n = 0;
+	for (unsigned long i = 0; i <= size; ++i) {
+		n += crossed[i];
+		if (n) unsafe[i] |= SPLIT_CROSSED;
+	}
+}
+
+// chooses the splits of each code segment (but not the direct page).
+void split_functions(const std::vector<proc_start> &procs) {
+
+	const char *name = infile ? infile : "";
+	bool warned = false;
+
+	for (unsigned segno = 0; segno < Segments.size() && segno < SegmentBodies.size(); ++segno) {
+		auto &s = Segments[segno];
+		if (s.omf_kind != 0) continue;
+
+		std::vector<const export_sym *> candidates;
+		std::vector<uint32_t> entries{ 0 };
+		for (const auto &e : s.exports) {
+			entries.push_back(e.offset);
+			if (e.offset == 0 || e.offset >= (uint32_t)s.size) continue;
+			if (!candidates.empty() && candidates.back()->offset == e.offset) continue;
+			candidates.push_back(&e);
+		}
+		if (candidates.empty()) continue;
+
+		if (procs.empty()) {
+			if (!warned) warnx("%s: no .proc scopes (assemble with -g); segments not split", name);
+			warned = true;
+			break;
+		}
+
+		for (const auto &p : procs)
+			if (p.section == segno) entries.push_back(p.offset);
+
+		std::vector<uint8_t> unsafe;
+		decode_code(SegmentBodies[segno], entries, unsafe);
+
+		for (const auto *e : candidates) {
+			bool proc = std::any_of(procs.begin(), procs.end(), [&](const proc_start &p){
+				return p.section == segno && p.offset == e->offset && p.name == e->name;
+			});
+			if (!proc) {
+				if (flag_v) warnx("%s: not split at %s (not the start of a .proc)", name,
+					std::string(e->name).c_str());
+				continue;
+			}
+			if (unsafe[e->offset]) {
+				warnx("%s: not split at %s (%s)", name, std::string(e->name).c_str(),
+					split_reason(unsafe[e->offset]));
+				continue;
+			}
+			s.splits.push_back(e->offset);
+		}
+	}
+}
+
 void flush_pending(std::vector<uint8_t> &omf, std::vector<uint8_t> &pending) {
 	if (!pending.empty()) {
 		auto n = pending.size();
@@ -350,24 +768,19 @@ void flush_pending(std::vector<uint8_t> &omf, std::vector<uint8_t> &pending) {
 	}
 }
 
-void process_segment(FILE *f, int segno) {
-
-	uint32_t size = Read32(f);
-	unsigned nm = ReadVar(f);
-	unsigned flags = ReadVar(f);
-	unsigned long expect_pc = ReadVar(f);
-	unsigned align = ReadVar(f);
-	unsigned as = Read8(f);
-	unsigned count = ReadVar(f);
+// only writes obj.segments[segno] and pieces (and uses the heap, not
+// MemberArena), so segments may be converted concurrently.
+void process_segment(const object_state &obj, int segno, std::vector<segment> &pieces) {
 
-	unsigned i;
+	const auto &body = obj.bodies[segno];
+	unsigned long expect_pc = body.pc;
 
-	auto &seg = Segments[segno];
-	auto &omf = seg.omf;
+	auto &seg = obj.segments[segno];
 	auto &exports = seg.exports;
 
-
+	std::vector<uint8_t> omf;
 	std::vector<uint8_t> pending;
+	bool labels = false;
 
 
 	auto iter = exports.begin();
@@ -378,15 +791,36 @@ void process_segment(FILE *f, int segno) {
 
 	next_export = iter == end ? - 1 : iter->offset;
 
+	// --function-segments
+	unsigned piece = 0;
+	unsigned long next_split = seg.splits.empty() ? -1 : (unsigned long)seg.splits.front();
+
+	auto finish_piece = [&](){
+		flush_pending(omf, pending);
+		if (omf.size()) omf.push_back(0x00); // end of segment opcode.
+		if (piece == 0) seg.omf = std::move(omf);
+		else pieces[piece - 1].omf = std::move(omf);
+		omf.clear();
+	};
 
-	for (i = 0; i < count; ++i) {
-		unsigned type = Read8(f);
-		unsigned n;
+	for (const auto &frag : body.fragments) {
+		unsigned type = frag.type;
+		unsigned n = frag.size;
 
 		if (next_export < pc) {
 			auto &e = *iter;
-			errx(1, "Unable to assign export %s: ($%04lx) pc=$%04lx",
-				e.name.c_str(), (long)e.offset, pc);
+			fatalx("Unable to assign export %s: ($%04lx) pc=$%04lx",
+				std::string(e.name).c_str(), (long)e.offset, pc);
+		}
+
+		if (next_split == pc) {
+			finish_piece();
+
+			segment s;
+			s.name = piece_name(seg, ++piece);
+			s.omf_kind = seg.omf_kind;
+			pieces.emplace_back(std::move(s));
+			next_split = piece < seg.splits.size() ? (unsigned long)seg.splits[piece] : -1;
 		}
 
 		while (next_export == pc) {
@@ -399,16 +833,13 @@ void process_segment(FILE *f, int segno) {
 			next_export = iter == end ? - 1 : iter->offset;
 		}
 
-		size_t pos;
 		switch(type & FRAG_TYPEMASK) {
 			case FRAG_LITERAL:
-				n = ReadVar(f);
 				// n bytes of data...
 				if (n == 0) break;
 
-				pos = pending.size();
-				pending.resize(pos + n);
-				fread(pending.data() + pos, 1, n, f);
+				pending.insert(pending.end(), obj.data.begin() + frag.data,
+					obj.data.begin() + frag.data + n);
 
 				pc += n;
 				break;
@@ -416,21 +847,31 @@ void process_segment(FILE *f, int segno) {
 			case FRAG_FILL:
 				flush_pending(omf, pending);
 
-				n = ReadVar(f);
 				omf.push_back(0xf1); // DS
 				push_back_32(omf, n);
 				pc += n;
 				break;
 
 			case FRAG_EXPR:
-			case FRAG_SEXPR:
+			case FRAG_SEXPR: {
+				const auto &ev = frag.expr;
+
+				// constant (eg, after --resolve) -- just data.
+				if (ev.size() == 1 && ev.front().op == EXPR_LITERAL) {
+					for (unsigned j = 0; j < n; ++j)
+						pending.push_back(ev.front().value >> (j * 8));
+					pc += n;
+					break;
+				}
+
 				flush_pending(omf, pending);
 
-				convert_expression(read_expr(f), type & FRAG_BYTEMASK, omf, segno);
-				pc += type & FRAG_BYTEMASK;
+				labels |= convert_expression(object_ref{ obj.segments, obj.imports }, ev, n, omf,
+					seg.merged >= 0 ? seg.merged : segno, piece);
+				pc += n;
 				break;
+			}
 		}
-		skip_info_list(f);
 	}
 
 	flush_pending(omf, pending);
@@ -444,28 +885,127 @@ void process_segment(FILE *f, int segno) {
 		next_export = iter == end ? - 1 : iter->offset;
 	}
 	if (iter != end) {
-		while (iter != end) {
+		for (; iter != end; ++iter) {
 			const auto &e = *iter;
 			warnx("Unable to assign export %s: ($%04lx) pc=$%04lx",
-				e.name.c_str(), (long)e.offset, pc);
+				std::string(e.name).c_str(), (long)e.offset, pc);
 		}
-		exit(1);
+		fatal_exit(1);
 	}
 
-	if (pc != expect_pc) errx(1, "PC Error");
+	if (pc != expect_pc) fatalx("PC Error");
+	if (next_split != (unsigned long)-1) fatalx("Unable to split segment %s at $%04lx",
+		std::string(seg.name).c_str(), next_split);
 
-	if (omf.size()) {
-		omf.push_back(0x00); // end of segment opcode.
-	}
+	finish_piece();
+
+	if (labels) seg.section_labels = true;
 
+	if (pieces.empty()) return;
+
+	for (auto &p : pieces)
+		p.section_labels = seg.section_labels;
+
+	// piece sizes and exports (relative to the piece).
+	std::vector<export_sym> tmp = std::move(seg.exports);
+	seg.exports.clear();
+	seg.size = seg.splits.front();
+	for (unsigned p = 0; p < pieces.size(); ++p) {
+		uint32_t start = seg.splits[p];
+		uint32_t stop = p + 1 < seg.splits.size() ? seg.splits[p + 1] : (uint32_t)pc;
+		pieces[p].size = stop - start;
+	}
+	for (auto &e : tmp) {
+		uint32_t offset = e.offset;
+		unsigned p = 0;
+		while (p < seg.splits.size() && offset >= seg.splits[p]) ++p;
+		if (p) {
+			e.offset -= seg.splits[p - 1];
+			pieces[p - 1].exports.emplace_back(std::move(e));
+		} else {
+			seg.exports.emplace_back(std::move(e));
+		}
+	}
 }
 
-void process_segments(FILE *f, long size) {
+void process_segments() {
+
+	unsigned n = SegmentBodies.size();
 
-	unsigned n = ReadVar(f);
+	std::vector<std::vector<segment>> pieces(n);
 
+	// large segments (font data, asset tables, ...) are converted in
+	// parallel; each one only depends on its own fragments and exports.
+	// Results are kept by segment number so the output order is unchanged.
+	const unsigned long parallel_size = 64 * 1024;
+
+	std::vector<unsigned> large;
 	for (unsigned i = 0; i < n; ++i)
-		process_segment(f, i);
+		if (SegmentBodies[i].pc >= parallel_size) large.push_back(i);
+	if (large.size() < 2) large.clear();
+
+	object_state obj{ Segments, Imports, SegmentBodies, SegmentData };
+
+	std::atomic<unsigned> next(0);
+	worker_errors errors;
+	auto worker = [&](){
+		errors.run([&](){
+			for (unsigned k; (k = next++) < large.size(); )
+				process_segment(obj, large[k], pieces[large[k]]);
+		});
+	};
+
+	std::vector<std::thread> threads;
+	unsigned nthreads = std::min<unsigned>(std::max(1u, std::thread::hardware_concurrency()), large.size());
+	for (unsigned i = 0; i < nthreads; ++i)
+		threads.emplace_back(worker);
+
+	errors.run([&](){
+		for (unsigned i = 0; i < n; ++i) {
+			if (SegmentBodies[i].pc >= parallel_size && !large.empty()) continue;
+			process_segment(obj, i, pieces[i]);
+		}
+	});
+	for (auto &t : threads) t.join();
+	errors.rethrow();
+
+	if (flag_merge_segments) {
+		std::vector<segment> tmp;
+		for (auto &seg : Segments) {
+			if (seg.merged < 0) continue;
+			auto &target = Segments[seg.merged];
+
+			if (seg.section_labels) target.section_labels = true;
+
+			if (!seg.omf.empty()) {
+				if (!target.omf.empty()) target.omf.pop_back(); // end of segment opcode.
+				target.omf.insert(target.omf.end(), seg.omf.begin(), seg.omf.end());
+			}
+			for (auto &e : seg.exports) {
+				e.offset += seg.base;
+				target.exports.emplace_back(std::move(e));
+			}
+			target.size = seg.base + seg.size;
+		}
+		for (auto &seg : Segments) {
+			if (seg.merged < 0) tmp.emplace_back(std::move(seg));
+		}
+		Segments = std::move(tmp);
+		return;
+	}
+
+	if (!flag_function_segments) return;
+
+	// pieces follow the segment they were split from.
+	std::vector<segment> tmp;
+	for (unsigned i = 0; i < Segments.size(); ++i) {
+		tmp.emplace_back(std::move(Segments[i]));
+		if (i < n) {
+			for (auto &s : pieces[i])
+				tmp.emplace_back(std::move(s));
+		}
+	}
+	Segments = std::move(tmp);
 }
 
 
@@ -480,6 +1020,12 @@ void read_segments(FILE *f, long size) {
 	// size is the on-disk size of the segment (excluding the size field)
 	// pc is the size of the generated code, after linking.
 
+	// fragments are parsed here, in the same pass, and converted
+	// by process_segments() after the exports are read.
+	SegmentBodies.reserve(count);
+	// the literal data can't be larger than the segment table.
+	SegmentData.reserve(size);
+
 	// default segs are generated, in this order:
 	// CODE, RODATA, BSS, DATA, ZERO PAGE, NULL
 	// ZEROPAGE has an address size of 1.
@@ -496,7 +1042,7 @@ void read_segments(FILE *f, long size) {
 		unsigned count = ReadVar(f);
 
 		segment seg;
-		seg.name = StringPool[nm];
+		seg.name = intern(StringPool[nm]);
 		seg.size = pc;
 
 		seg.omf_kind = 0; // code
@@ -505,19 +1051,61 @@ void read_segments(FILE *f, long size) {
 
 		Segments.emplace_back(std::move(seg));
 
-		fseek(f, pos + size + 4, SEEK_SET);
-	}
-
-
-}
+		SegmentBodies.emplace_back(pc);
+		auto &fragments = SegmentBodies.back().fragments;
+		fragments.reserve(count);
+
+		for (unsigned j = 0; j < count; ++j) {
+			unsigned type = Read8(f);
+			unsigned long n = 0;
+			size_t data = 0;
+			expr_vector ev(&MemberArena);
+
+			switch(type & FRAG_TYPEMASK) {
+				case FRAG_LITERAL:
+					n = ReadVar(f);
+					data = SegmentData.size();
+					SegmentData.resize(data + n);
+					ReadData(f, SegmentData.data() + data, n);
+					break;
+				case FRAG_FILL:
+					n = ReadVar(f);
+					break;
+				case FRAG_EXPR:
+				case FRAG_SEXPR:
+					n = type & FRAG_BYTEMASK;
+					ev = read_expr(f);
+					break;
+			}
+			skip_info_list(f);
 
-void process_obj(FILE *f, bool save) {
+			fragments.emplace_back(type, n, data, std::move(ev));
+		}
 
+		if (ftell(f) != pos + size + 4) fatalx("Bad segment size");
+	}
 
-	ObjHeader h;
+	// --merge-segments: everything but the direct page goes in the first
+	// segment, so section references become OMF_REL.
+	if (flag_merge_segments) {
+		int target = -1;
+		uint32_t base = 0;
+		for (unsigned i = 0; i < Segments.size(); ++i) {
+			auto &seg = Segments[i];
+			if (seg.omf_kind != 0) continue;
+			if (target < 0) {
+				target = i;
+			} else {
+				seg.merged = target;
+				seg.base = base;
+			}
+			base += seg.size;
+		}
+	}
 
-	long base = ftell(f);
+}
 
+void read_obj_header(FILE *f, ObjHeader &h) {
 
 	h.Magic = Read32(f);
 	h.Version = Read16(f);
@@ -547,15 +1135,37 @@ void process_obj(FILE *f, bool save) {
 
 
 	if (h.Magic != OBJ_MAGIC)
-		errx(1, "Bad magic");
+		fatalx("Bad magic");
 	if (h.Version != OBJ_VERSION)
-		errx(1, "Bad version");
+		fatalx("Bad version");
+}
+
+// an OMF object file -- the non-empty segments, numbered from 1.
+void save_omf_object(const std::string &path, const std::vector<segment> &segments) {
+
+	std::vector<uint8_t> data;
+	int segno = 0;
+	for (const auto &seg : segments) {
+		if (!seg.omf.empty())
+			save_omf_segment(data, seg, ++segno);
+	}
+	write_output(path, std::move(data), 0xb1);
+}
 
+void process_obj(FILE *f, bool save) {
+
+
+	ObjHeader h;
+
+	long base = ftell(f);
+
+	read_obj_header(f, h);
 
 	// 1. read the string pool.
 	// 2. read the imports
-	// 3. read the exports
-	// 4. convert the segments.
+	// 3. read the segments (headers and fragments)
+	// 4. read the exports
+	// 5. convert the segments.
 
 	fseek(f, base + h.StrPoolOffs, SEEK_SET);
 	read_strings(f, h.StrPoolSize);
@@ -568,26 +1178,25 @@ void process_obj(FILE *f, bool save) {
 	read_segments(f, h.SegSize);	
 
 	fseek(f, base + h.ExportOffs, SEEK_SET);
-	read_exports(f, h.ExportSize);
+	read_exports(f, h.ExportSize, flag_shared_equates && !save);
 
-	fseek(f, base + h.SegOffs, SEEK_SET);
-	process_segments(f, h.SegSize);
+	if (flag_function_segments) {
+		std::vector<proc_start> procs;
+		read_procs(f, base, h, procs);
+		split_functions(procs);
+	}
+
+	process_segments();
 
 
 	if (save) {
 		if (!outfile) outfile = "out.omf";
-		FILE *out = fopen(outfile, "wb");
-		int segno = 0;
-		for (auto &seg : Segments) {
-			if (!seg.omf.empty())
-				save_omf_segment(out, seg, ++segno);
-		}
-		fclose(out);
-		set_prodos_file_type(outfile, 0xb1, 0x0000);
+		save_omf_object(outfile, Segments);
 	}
 }
 
-void process_lib(FILE *f) {
+// read the ar65 library index.
+void read_lib_index(FILE *f, std::vector<lib_member> &members) {
 
 	struct LibHeader h;
 
@@ -598,35 +1207,467 @@ void process_lib(FILE *f) {
 
 
 	if (h.Magic != LIB_MAGIC)
-		errx(1, "Bad magic");
+		fatalx("Bad magic");
 	if (h.Version != LIB_VERSION)
-		errx(1, "Bad version");
+		fatalx("Bad version");
 
 	fseek(f, h.IndexOffs, SEEK_SET);
 
 	unsigned count = ReadVar(f);
+	members.reserve(count);
 	for (unsigned i = 0; i < count; ++i) {
-		std::string name = ReadString(f);
-		unsigned flags = Read16(f);
-		unsigned long mtime = Read32(f);
-		unsigned long offset = Read32(f);
-		unsigned long size = Read32(f);
+		lib_member m;
+		m.name = ReadString(f);
+		m.flags = Read16(f);
+		m.mtime = Read32(f);
+		m.offset = Read32(f);
+		m.size = Read32(f);
+		members.emplace_back(std::move(m));
+	}
+}
 
-		unsigned long pos = ftell(f);
-		fseek(f, offset, SEEK_SET);
-		process_obj(f, false);
-		fseek(f, pos, SEEK_SET);
+// --shared-equates: one member with every literal export in the library.
+void share_equates(std::vector<file> &files) {
+
+	// keyed by interned name.
+	std::unordered_map<const char *, std::pair<uint32_t, const file *>> values;
+	segment seg;
+	unsigned count = 0;
+	unsigned conflicts = 0;
+
+	seg.name = intern("GLOBALS");
+
+	for (auto &f : files) {
+		for (auto &e : f.equates) {
+			++count;
+			uint32_t value = e.expr.front().value;
+			auto iter = values.find(e.name.data());
+			if (iter != values.end()) {
+				if (iter->second.first != value) {
+					warnx("%s: %s = $%04x conflicts with $%04x in %s", f.name.c_str(),
+						std::string(e.name).c_str(), value, iter->second.first, iter->second.second->name.c_str());
+					++conflicts;
+				}
+				continue;
+			}
+			values.emplace(e.name.data(), std::make_pair(value, &f));
+			convert_gequ(e.name, e.expr, seg.omf);
+			seg.exports.emplace_back(std::move(e));
+		}
+		f.equates.clear();
+	}
 
-		file f;
-		f.name = std::move(name);
-		f.number = i + 1;
-		f.segments = std::move(Segments);
+	if (seg.exports.empty()) return;
 
-		Files.emplace_back(std::move(f));
+	seg.omf.push_back(0x00); // end!
 
-		reset();
+	file f;
+	f.name = "EQUATES";
+	f.number = files.size() + 1;
+	f.segments.emplace_back(std::move(seg));
+
+	printf("%u equates (%u unique, %u conflicting) in member %s\n",
+		count, (unsigned)values.size(), conflicts, f.name.c_str());
+
+	files.emplace_back(std::move(f));
+}
+
+// an object to convert -- a file, or a member of an ar65 library.
+struct member_source {
+	std::string path;
+	std::string name;
+	unsigned long offset = 0;
+};
+
+// members are converted in parallel (--split, --library).  Each thread
+// has its own object state (see MemberArena) and opens its own FILEs.
+// files[i] is sources[i], so the order doesn't depend on the threads.
+void convert_members(const std::vector<member_source> &sources, std::vector<file> &files) {
+
+	files.clear();
+	files.resize(sources.size());
+
+	std::atomic<unsigned> next(0);
+	worker_errors errors;
+	const char *name = infile;
+	auto worker = [&](){
+		FILE *f = nullptr;
+		const std::string *path = nullptr;
+		infile = name; // for warnings.
+
+		errors.run([&](){
+			for (unsigned i; (i = next++) < sources.size(); ) {
+				const auto &s = sources[i];
+				if (!path || *path != s.path) {
+					if (f) fclose(f);
+					path = &s.path;
+					f = fopen(path->c_str(), "rb");
+					if (!f) fatal("Unable to open file %s", path->c_str());
+				}
+				fseek(f, s.offset, SEEK_SET);
+				process_obj(f, false);
+
+				auto &mf = files[i];
+				mf.name = s.name;
+				mf.number = i + 1;
+				mf.imports.assign(Imports.begin(), Imports.end());
+				mf.segments = std::move(Segments);
+				mf.equates = std::move(Equates);
+
+				reset();
+			}
+		});
+		if (f) fclose(f);
+	};
+
+	unsigned n = std::min<unsigned>(std::max(1u, std::thread::hardware_concurrency()), sources.size());
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < n; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (auto &t : threads) t.join();
+	errors.rethrow();
+}
+
+void process_members();
+
+// member cache keys start with the options (and --resolve constants) and
+// the library's absolute path, since server requests come from anywhere.
+static std::string cache_prefix(const std::string &path) {
+
+	uint64_t h = cache_options;
+	for (const auto &kv : Constants) {
+		h = h * 31 + (uintptr_t)kv.first;
+		h = h * 31 + kv.second;
+	}
+
+	std::string rv = std::to_string(h) + ":";
+	if (path.empty() || path.front() != '/') {
+		char *cwd = getcwd(nullptr, 0);
+		if (cwd) {
+			rv += cwd;
+			rv += "/";
+			free(cwd);
+		}
+	}
+	return rv + path + ":";
+}
+
+void process_lib(FILE *f) {
+
+	std::vector<lib_member> members;
+
+	read_lib_index(f, members);
+
+	Files.clear();
+
+	if (split_dir) {
+		if (!infile) fatalx("--split needs an input file");
+		std::vector<member_source> sources(members.size());
+		for (unsigned i = 0; i < members.size(); ++i) {
+			sources[i].path = infile;
+			sources[i].name = std::move(members[i].name);
+			sources[i].offset = members[i].offset;
+		}
+		convert_members(sources, Files);
+	} else {
+		std::string prefix;
+		std::unordered_set<std::string> cached;
+		if (flag_cache) {
+			prefix = cache_prefix(infile ? infile : "");
+			if (MemberCache.size() > max_cached_members) MemberCache.clear();
+		}
+
+		unsigned count = members.size();
+		for (unsigned i = 0; i < count; ++i) {
+			std::string name = std::move(members[i].name);
+			unsigned long offset = members[i].offset;
+			unsigned long size = members[i].size;
+
+			fseek(f, offset, SEEK_SET);
+
+			member_cache_entry *cache = nullptr;
+			uint64_t hash = 0;
+			if (flag_cache) {
+				std::vector<uint8_t> data(size);
+				ReadData(f, data.data(), size);
+				fseek(f, offset, SEEK_SET);
+				hash = hash_data(data.data(), size);
+				cache = &MemberCache[*cached.insert(prefix + name).first];
+			}
+
+			if (cache && cache->hash == hash && cache->size == size) {
+				Imports.assign(cache->imports.begin(), cache->imports.end());
+				Segments = cache->segments;
+				Equates = cache->equates;
+			} else {
+				process_obj(f, false);
+				if (cache) {
+					cache->hash = hash;
+					cache->size = size;
+					cache->imports.assign(Imports.begin(), Imports.end());
+					cache->segments = Segments;
+					cache->equates = Equates;
+				}
+			}
+
+			file f;
+			f.name = std::move(name);
+			f.number = i + 1;
+			f.imports.assign(Imports.begin(), Imports.end());
+			f.segments = std::move(Segments);
+			f.equates = std::move(Equates);
+
+			Files.emplace_back(std::move(f));
+
+			reset();
+		}
+
+		// forget members that are no longer in the library.
+		if (flag_cache) {
+			for (auto iter = MemberCache.begin(); iter != MemberCache.end(); ) {
+				if (!iter->first.compare(0, prefix.size(), prefix) && !cached.count(iter->first))
+					iter = MemberCache.erase(iter);
+				else ++iter;
+			}
+		}
+	}
+
+	process_members();
+}
+
+// --library: one OMF library from cc65 objects, ar65 libraries and OMF
+// libraries, in the order given.  Members are renumbered; a symbol
+// exported by more than one member is reported (the first one wins).
+void process_objs(const std::vector<std::string> &paths) {
+
+	struct input {
+		bool omf = false;
+		size_t first = 0; // sources
+		size_t count = 0;
+	};
+
+	std::vector<input> inputs(paths.size());
+	std::vector<member_source> sources;
+
+	for (unsigned i = 0; i < paths.size(); ++i) {
+		const auto &path = paths[i];
+		auto &in = inputs[i];
+
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f) fatal("Unable to open file %s", path.c_str());
+
+		in.first = sources.size();
+		close_on_error(f, [&](){
+			uint32_t magic = Read32(f);
+			rewind(f);
+
+			if (magic == OBJ_MAGIC) {
+				auto slash = path.rfind('/');
+				member_source ms;
+				ms.path = path;
+				ms.name = slash == path.npos ? path : path.substr(slash + 1);
+				sources.emplace_back(std::move(ms));
+			} else if (magic == LIB_MAGIC) {
+				std::vector<lib_member> members;
+				read_lib_index(f, members);
+				for (auto &m : members) {
+					member_source ms;
+					ms.path = path;
+					ms.name = std::move(m.name);
+					ms.offset = m.offset;
+					sources.emplace_back(std::move(ms));
+				}
+			} else if (is_omf_library(f)) {
+				in.omf = true;
+			} else {
+				fatalx("%s is not a cc65 object or library, or an OMF library", path.c_str());
+			}
+		});
+		in.count = sources.size() - in.first;
+		fclose(f);
+	}
+
+	std::vector<file> converted;
+	convert_members(sources, converted);
+
+	// where each member came from, for conflicts.
+	std::vector<std::string> origins;
+	Files.clear();
+	for (unsigned i = 0; i < paths.size(); ++i) {
+		const auto &in = inputs[i];
+		if (in.omf) {
+			size_t first = Files.size();
+			read_omf_library(paths[i], Files);
+			for (size_t j = first; j < Files.size(); ++j) {
+				// its equates can't be told apart (or replaced) by member.
+				if (flag_shared_equates && Files[j].name == "EQUATES")
+					fatalx("%s already has an EQUATES member; it can't be used with --shared-equates.", paths[i].c_str());
+				origins.emplace_back(paths[i] + "(" + Files[j].name + ")");
+			}
+			continue;
+		}
+		for (size_t j = in.first; j < in.first + in.count; ++j) {
+			const auto &s = sources[j];
+			origins.emplace_back(s.offset ? s.path + "(" + s.name + ")" : s.path);
+			Files.emplace_back(std::move(converted[j]));
+		}
 	}
 
+	std::unordered_map<const char *, unsigned> exporters;
+	unsigned conflicts = 0;
+	for (unsigned i = 0; i < Files.size(); ++i) {
+		Files[i].number = i + 1;
+		for (const auto &seg : Files[i].segments) {
+			if (seg.omf.empty()) continue;
+			for (const auto &e : seg.exports) {
+				if (e.priv) continue;
+				auto iter = exporters.emplace(e.name.data(), i).first;
+				if (iter->second == i) continue;
+				warnx("%s: exported by %s and %s", std::string(e.name).c_str(),
+					origins[iter->second].c_str(), origins[i].c_str());
+				++conflicts;
+			}
+		}
+	}
+	if (conflicts)
+		printf("%u conflicting symbol%s (the first definition wins)\n",
+			conflicts, conflicts == 1 ? "" : "s");
+
+	process_members();
+}
+
+// --update lib obj...: replace (by name) or append members of an existing
+// OMF library.  Only the objects are converted; the other members keep
+// their segment bodies and the dictionary is rebuilt.
+void process_update(const std::string &library, const std::vector<std::string> &paths) {
+
+	FILE *f = fopen(library.c_str(), "rb");
+	if (!f) fatal("Unable to open file %s", library.c_str());
+	bool omf = is_omf_library(f);
+	fclose(f);
+	if (!omf) fatalx("%s is not an OMF library", library.c_str());
+
+	std::vector<member_source> sources;
+	for (const auto &path : paths) {
+		f = fopen(path.c_str(), "rb");
+		if (!f) fatal("Unable to open file %s", path.c_str());
+		int type = -1;
+		close_on_error(f, [&](){ type = file_type(f); });
+		fclose(f);
+		if (type != 0) fatalx("%s is not a cc65 object", path.c_str());
+
+		auto slash = path.rfind('/');
+		member_source ms;
+		ms.path = path;
+		ms.name = slash == path.npos ? path : path.substr(slash + 1);
+		sources.emplace_back(std::move(ms));
+	}
+
+	// members are matched by name.
+	std::unordered_set<std::string> names;
+	for (const auto &ms : sources) {
+		if (!names.insert(ms.name).second)
+			fatalx("%s is given more than once", ms.name.c_str());
+	}
+
+	// the library is usually written over, so it must be read back exactly
+	// before anything is converted.
+	Files.clear();
+	read_omf_library(library, Files, true);
+
+	names.clear();
+	for (const auto &mf : Files) {
+		if (!names.insert(mf.name).second)
+			fatalx("%s: more than one member is named %s", library.c_str(), mf.name.c_str());
+	}
+
+	std::vector<file> converted;
+	convert_members(sources, converted);
+
+	unsigned replaced = 0;
+	unsigned added = 0;
+	for (auto &mf : converted) {
+		auto iter = std::find_if(Files.begin(), Files.end(), [&](const file &x){
+			return x.name == mf.name;
+		});
+		if (flag_v) printf("%s %s\n", iter == Files.end() ? "added" : "replaced", mf.name.c_str());
+		if (iter == Files.end()) {
+			Files.emplace_back(std::move(mf));
+			++added;
+		} else {
+			*iter = std::move(mf);
+			++replaced;
+		}
+	}
+	printf("%u member%s replaced, %u added\n", replaced, replaced == 1 ? "" : "s", added);
+
+	for (unsigned i = 0; i < Files.size(); ++i)
+		Files[i].number = i + 1;
+
+	process_members();
+}
+
+void save_omf_library(const std::string &path, const std::vector<file> &files);
+
+// out.lib -> out1.lib
+static std::string part_name(const std::string &path, unsigned part) {
+	auto slash = path.rfind('/');
+	auto dot = path.rfind('.');
+	if (dot == path.npos || (slash != path.npos && dot < slash) || dot == slash + 1)
+		return path + std::to_string(part);
+	return path.substr(0, dot) + std::to_string(part) + path.substr(dot);
+}
+
+// equates, roots and ordering, then the library (or libraries, or --split
+// objects) from Files.
+void process_members() {
+
+	if (flag_shared_equates) share_equates(Files);
+	if (!Roots.empty()) shake_members(Files, Roots);
+	if (flag_order) order_members(Files);
+	if (graph_file) write_member_graph(graph_file, Files);
+
+	// --split: one OMF object per member instead of a library.
+	if (split_dir) {
+		for (const auto &f : Files)
+			save_omf_object(output_name(f.name, 0, split_dir), f.segments);
+		return;
+	}
+
+	if (!outfile) outfile = "out.lib";
+
+	// file numbers are 16-bit, so a library holds at most 65535 members.
+	unsigned members = max_members ? max_members : 0xffff;
+	unsigned long size = 0;
+	if (max_lib_size) {
+		for (const auto &f : Files)
+			size += member_size(f);
+	}
+
+	if (Files.size() <= members && size <= max_lib_size) {
+		save_omf_library(outfile, Files);
+		return;
+	}
+
+	auto parts = partition_members(Files, members, max_lib_size);
+	for (unsigned i = 0; i < parts.size(); ++i) {
+		auto path = part_name(outfile, i + 1);
+		unsigned long n = 0;
+		for (const auto &f : parts[i])
+			n += member_size(f);
+		printf("%s: %u member%s, %lu bytes\n", path.c_str(), (unsigned)parts[i].size(),
+			parts[i].size() == 1 ? "" : "s", n);
+		if (flag_v) {
+			for (const auto &f : parts[i])
+				printf("  %s\n", f.name.c_str());
+		}
+		save_omf_library(path, parts[i]);
+	}
+}
+
+void save_omf_library(const std::string &path, const std::vector<file> &files) {
+
 	// library segment consists of 3 lconst records:
 	// 1. filenames
 	// - { uint16_t fileno, pstring name}*
@@ -642,98 +1683,497 @@ void process_lib(FILE *f) {
 	std::vector<uint8_t> file_names;
 	std::vector<uint8_t> symbol_table;
 	std::vector<uint8_t> symbol_names;
-	std::unordered_map<std::string, uint32_t> symbol_map;
+	// names are interned, so the address identifies the name.
+	std::unordered_map<const char *, uint32_t> symbol_map;
+	std::vector<std::string_view> names;
 
 
 	// file names
-	for (const auto &f : Files) {
+	for (const auto &f : files) {
 		push_back_16(file_names, f.number);
 		push_back_string(file_names, f.name);
 	}
 
+	// --dedup: a segment identical to an earlier one is stored once.  The
+	// bodies include the GLOBAL records, so its exports are the kept
+	// segment's and its dictionary and index entries are dropped as well.  Segments
+	// that refer to other segments by name or have private exports aren't
+	// shared, and neither are segments their own member refers to by name
+	// (the dropped segment name entry would be needed).
+	std::unordered_map<const segment *, const segment *> duplicates;
+	if (flag_dedup) {
+		std::unordered_multimap<uint64_t, const segment *> kept;
+		for (const auto &f : files) {
+			std::unordered_set<const char *> named;
+			for (const auto &seg : f.segments) {
+				if (seg.omf.empty() || !seg.section_labels) continue;
+				std::vector<std::string_view> refs;
+				omf_references(seg, refs);
+				for (const auto &name : refs) named.insert(name.data());
+			}
+
+			for (const auto &seg : f.segments) {
+				if (seg.omf.empty() || seg.section_labels) continue;
+				if (std::any_of(seg.exports.begin(), seg.exports.end(), [](const export_sym &e){ return e.priv; }))
+					continue;
+
+				uint64_t hash = hash_data(seg.omf.data(), seg.omf.size());
+				const segment *match = nullptr;
+				auto range = kept.equal_range(hash);
+				for (auto iter = range.first; iter != range.second; ++iter) {
+					const auto &k = *iter->second;
+					if (k.omf_kind == seg.omf_kind && k.size == seg.size && k.omf == seg.omf) {
+						match = &k;
+						break;
+					}
+				}
+				if (!match) kept.emplace(hash, &seg);
+				else if (!named.count(seg.name.data())) duplicates.emplace(&seg, match);
+			}
+		}
+	}
+
 	unsigned symbol_count = 0;
 	// symbol names
-	for (const auto &f : Files) {
+	for (const auto &f : files) {
 		for (const auto &seg : f.segments) {
-			if (seg.omf.empty()) continue;
+			if (seg.omf.empty() || duplicates.count(&seg)) continue;
 
 			symbol_count++;
-			auto &name = seg.name;
-			if (symbol_map.find(name) == symbol_map.end()) {
-				uint32_t offset = symbol_names.size();
-				symbol_map.emplace(name, offset);
-				push_back_string(symbol_names, name);
-			}
+			auto name = seg.name;
+			if (symbol_map.emplace(name.data(), 0).second)
+				names.push_back(name);
 			for(const auto &e : seg.exports) {
 				symbol_count++;
-				auto &name = e.name;
-				if (symbol_map.find(name) == symbol_map.end()) {
-					uint32_t offset = symbol_names.size();
-					symbol_map.emplace(name, offset);
-					push_back_string(symbol_names, name);
-				}
+				auto name = e.name;
+				if (symbol_map.emplace(name.data(), 0).second)
+					names.push_back(name);
 			}
 		}
 	}
 
+	if (flag_sort) std::sort(names.begin(), names.end());
+
+	for (const auto &name : names) {
+		symbol_map[name.data()] = symbol_names.size();
+		push_back_string(symbol_names, name);
+	}
+
 	// symbols deferred until segment offset is known.
-	symbol_table.reserve(symbol_count * 12);
+	struct dict_entry {
+		std::string_view name;
+		unsigned file;
+		bool priv;
+		uint32_t address;
+	};
+	std::vector<dict_entry> dictionary;
+	dictionary.reserve(symbol_count);
 
 	// lconst + end + segment header overhead.
 	long address = 5 * 3 + 1 + 62 + file_names.size() + symbol_names.size() + symbol_count * 12;
 
-	if (!outfile) outfile = "out.lib";
-	FILE *out = fopen(outfile, "wb");
-	fseek(out, address, SEEK_SET);
+	std::vector<uint8_t> segments;
+
+	std::vector<index_entry> index;
+
+	unsigned long saved = 0;
+	unsigned dups = 0;
 
-	for (const auto &f : Files) {
+	for (const auto &f : files) {
 		unsigned segno = 0;
 		for (const auto &seg : f.segments) {
 			if (seg.omf.empty()) continue;
-			// seg.address = address;
 
-			auto &name = seg.name;
-
-			push_back_32(symbol_table, symbol_map.at(name));
-			push_back_16(symbol_table, f.number);
-			push_back_16(symbol_table, 1); // private
-			push_back_32(symbol_table, address);
+			if (duplicates.count(&seg)) {
+				saved += 48 + 10 + 1 + seg.name.size() + seg.omf.size();
+				++dups;
+				continue;
+			}
 
+			dictionary.push_back({ seg.name, f.number, true, (uint32_t)address });
 
 			for (const auto &e : seg.exports) {
-				auto &name = e.name;
-
-				push_back_32(symbol_table, symbol_map.at(name));
-				push_back_16(symbol_table, f.number);
-				push_back_16(symbol_table, 0); // public
-				push_back_32(symbol_table, address);
 
+				dictionary.push_back({ e.name, f.number, e.priv, (uint32_t)address });
+
+				if (flag_index) {
+					index_entry ie;
+					ie.name = e.name;
+					ie.member = f.name;
+					ie.segment = seg.name;
+					ie.offset = e.offset;
+					ie.file = f.number;
+					ie.segno = segno + 1;
+					index.emplace_back(std::move(ie));
+				}
 			}
-			address += save_omf_segment(out, seg, ++segno);
+
+			address += save_omf_segment(segments, seg, ++segno);
+		}
+	}
+
+	if (flag_dedup)
+		printf("%u duplicate segment%s removed, %lu bytes saved\n",
+			dups, dups == 1 ? "" : "s", saved);
+
+	// sorted by name (then file, then address) so the dictionary can be binary searched.
+	if (flag_sort) {
+		std::stable_sort(dictionary.begin(), dictionary.end(), [](const dict_entry &a, const dict_entry &b){
+			return a.name < b.name;
+		});
+	}
+
+	symbol_table.reserve(symbol_count * 12);
+	for (const auto &d : dictionary) {
+		push_back_32(symbol_table, symbol_map.at(d.name.data()));
+		push_back_16(symbol_table, d.file);
+		push_back_16(symbol_table, d.priv ? 1 : 0);
+		push_back_32(symbol_table, d.address);
+	}
+
+	std::vector<uint8_t> data;
+	data.reserve(address);
+	save_omf_lib_header(data, file_names, symbol_table, symbol_names);
+	data.insert(data.end(), segments.begin(), segments.end());
+	write_output(path, std::move(data), 0xb2);
+
+	if (flag_index) {
+		std::string idx = path + ".idx";
+		write_symbol_index(idx, index);
+		Outputs.emplace_back(std::move(idx));
+	}
+}
+
+
+// foo.o -> foo.omf, foo.lib -> foo.omflib, optionally in another directory.
+std::string output_name(const std::string &path, int type, const char *dir) {
+
+	std::string name = path;
+	auto slash = name.rfind('/');
+	if (dir && *dir) {
+		if (slash != name.npos) name = name.substr(slash + 1);
+		name = std::string(dir) + "/" + name;
+		slash = name.rfind('/');
+	}
+
+	auto dot = name.rfind('.');
+	if (dot != name.npos && (slash == name.npos || dot > slash))
+		name.resize(dot);
+
+	name += type ? ".omflib" : ".omf";
+	return name;
+}
+
+// convert a single object or library.
+void convert_file(FILE *f, const std::string &in, const std::string &out) {
+
+	infile = in.c_str();
+	outfile = out.c_str();
+
+	try {
+		switch(file_type(f)) {
+			case 0: process_obj(f, true); break;
+			case 1: process_lib(f); break;
 		}
+	} catch (const fatal_error &) {
+		reset();
+		infile = nullptr;
+		outfile = nullptr;
+		throw;
+	}
+	reset();
+
+	infile = nullptr;
+	outfile = nullptr;
+}
+
+void convert_file(const std::string &in, const std::string &out) {
+
+	FILE *f = fopen(in.c_str(), "rb");
+	if (!f) fatal("Unable to open file %s", in.c_str());
+
+	close_on_error(f, [&](){ convert_file(f, in, out); });
+	fclose(f);
+}
+
+int file_type(const std::string &path) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) fatal("Unable to open file %s", path.c_str());
+	int type = -1;
+	close_on_error(f, [&](){ type = file_type(f); });
+	fclose(f);
+	return type;
+}
+
+// make-style escaping.
+static void write_dep_name(FILE *f, const std::string &name) {
+	for (char c : name) {
+		if (c == ' ' || c == '#') fputc('\\', f);
+		if (c == '$') fputc('$', f);
+		fputc(c, f);
 	}
-	fseek(out, 0, SEEK_SET);
-	save_omf_lib_header(out, file_names, symbol_table, symbol_names);
-	fclose(out);
-	set_prodos_file_type(outfile, 0xb2, 0x0000);
+}
+
+void write_depfile(const std::string &path, const std::vector<std::string> &inputs) {
+
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f) fatal("Unable to open %s", path.c_str());
+
+	bool first = true;
+	for (const auto &s : Outputs) {
+		if (!first) fputs(" \\\n ", f);
+		write_dep_name(f, s);
+		first = false;
+	}
+	fputc(':', f);
+	for (const auto &s : inputs) {
+		fputs(" \\\n  ", f);
+		write_dep_name(f, s);
+	}
+	for (const auto &s : OptionInputs) {
+		fputs(" \\\n  ", f);
+		write_dep_name(f, s);
+	}
+	fputc('\n', f);
+	fclose(f);
+}
+
+// foo.omf -> foo.d
+std::string default_depfile(const std::string &path) {
+	auto slash = path.rfind('/');
+	auto dot = path.rfind('.');
+	if (dot == path.npos || (slash != path.npos && dot < slash))
+		return path + ".d";
+	return path.substr(0, dot) + ".d";
+}
+
+static void digest_option(const char *name, const char *arg = nullptr) {
+	DigestOptions += name;
+	DigestOptions.push_back(0);
+	if (arg) {
+		DigestOptions += arg;
+		DigestOptions.push_back(0);
+	}
+}
+
+// --resolve file
+// name [=|equ|gequ] value, one per line.  value is decimal, $hex or 0xhex.
+// ; and # start comments.
+void read_constants(const char *path) {
+
+	FILE *f = fopen(path, "r");
+	if (!f) fatal("Unable to open %s", path);
+	OptionInputs.emplace_back(path);
+
+	char buffer[1024];
+	unsigned line = 0;
+	close_on_error(f, [&](){
+		while (fgets(buffer, sizeof(buffer), f)) {
+			++line;
+
+			char *cp = strpbrk(buffer, ";#");
+			if (cp) *cp = 0;
+
+			std::vector<std::string> words;
+			for (cp = strtok(buffer, " \t\r\n="); cp; cp = strtok(nullptr, " \t\r\n="))
+				words.emplace_back(cp);
+
+			if (words.empty()) continue;
+			if (words.size() == 3 && (!strcasecmp(words[1].c_str(), "equ") || !strcasecmp(words[1].c_str(), "gequ")))
+				words.erase(words.begin() + 1);
+			if (words.size() != 2)
+				fatalx("%s:%u: expected name = value", path, line);
+
+			const char *value = words[1].c_str();
+			int base = 10;
+			if (*value == '$') { ++value; base = 16; }
+			else if (value[0] == '0' && (value[1] == 'x' || value[1] == 'X')) { value += 2; base = 16; }
+
+			char *end;
+			unsigned long x = strtoul(value, &end, base);
+			if (!*value || *end)
+				fatalx("%s:%u: bad value %s", path, line, words[1].c_str());
+
+			Constants[intern(words[0]).data()] = x;
+			digest_option("--resolve", (words[0] + "=" + std::to_string(x)).c_str());
+		}
+	});
+	fclose(f);
+}
+
+// --roots a,b,c or --roots @file (names separated by commas or whitespace)
+void add_roots(const char *arg) {
+
+	std::string text;
+
+	if (*arg == '@') {
+		FILE *f = fopen(arg + 1, "r");
+		if (!f) fatal("Unable to open %s", arg + 1);
+		OptionInputs.emplace_back(arg + 1);
+		int c;
+		while ((c = fgetc(f)) != EOF) text.push_back(c);
+		fclose(f);
+	} else {
+		text = arg;
+	}
+
+	size_t first = Roots.size();
+	std::string name;
+	for (char c : text) {
+		if (c == ',' || isspace((unsigned char)c)) {
+			if (!name.empty()) Roots.emplace_back(std::move(name));
+			name.clear();
+			continue;
+		}
+		name.push_back(c);
+	}
+	if (!name.empty()) Roots.emplace_back(std::move(name));
+
+	for (size_t i = first; i < Roots.size(); ++i)
+		digest_option("--roots", Roots[i].c_str());
+}
+
+// 100, 64k, 2m
+static unsigned parse_count(const char *arg, unsigned max) {
+	char *end;
+	errno = 0;
+	unsigned long n = strtoul(arg, &end, 10);
+	if (end == arg || *end || *arg == '-' || errno || n == 0 || n > max)
+		fatalx("Invalid count: %s (1-%u)", arg, max);
+	return n;
+}
+
+static unsigned long parse_size(const char *arg) {
+	char *end;
+	unsigned long n = strtoul(arg, &end, 10);
+	if (*end == 'k' || *end == 'K') { n *= 1024; ++end; }
+	else if (*end == 'm' || *end == 'M') { n *= 1024 * 1024; ++end; }
+	if (end == arg || *end || n == 0)
+		fatalx("Invalid size: %s", arg);
+	return n;
 }
 
 
 void show_usage(int ex) {
 
-	fputs("cc65-to-omf [-o outfile] infile\n", stdout);
-	exit(ex);
+	fputs("cc65-to-omf [-u] [-MD] [-MF depfile] [-o outfile] infile\n", stdout);
+	fputs("cc65-to-omf [-u] [-MD] [-o outdir] infile...\n", stdout);
+	fputs("  -u          skip conversion if outfile is up to date\n", stdout);
+	fputs("  -MD         write a make-style dependency file\n", stdout);
+	fputs("  -MF file    dependency file name (implies -MD)\n", stdout);
+	fputs("  infile...   with more than one input, convert each one to\n", stdout);
+	fputs("              name.omf or name.omflib in the -o directory, if specified.\n", stdout);
+	fputs("  --watch dir...\n", stdout);
+	fputs("              convert objects and libraries in dir as they change.\n", stdout);
+	fputs("              outputs go in the -o directory, if specified.\n", stdout);
+	fputs("  --list-symbols[=json] infile...\n", stdout);
+	fputs("              list imports (U) and exports (T, A, I) without converting.\n", stdout);
+	fputs("  --check infile...\n", stdout);
+	fputs("              resolve imports and exports without linking.  -v shows\n", stdout);
+	fputs("              the library member that satisfies each import.\n", stdout);
+	fputs("  --resolve file\n", stdout);
+	fputs("              replace imports defined in file (name = value) with constants.\n", stdout);
+	fputs("  --sort-dictionary\n", stdout);
+	fputs("              sort the library dictionary and names by symbol name.\n", stdout);
+	fputs("  --order-members\n", stdout);
+	fputs("              order library members so importers precede exporters.\n", stdout);
+	fputs("  --function-segments\n", stdout);
+	fputs("              split code segments into separate OMF segments at exported\n", stdout);
+	fputs("              .procs (ca65 -g) that no code falls through into or branches\n", stdout);
+	fputs("              across.\n", stdout);
+	fputs("  --merge-segments\n", stdout);
+	fputs("              merge each object's segments (except the direct page) into one.\n", stdout);
+	fputs("  --library infile...\n", stdout);
+	fputs("              build one OMF library from cc65 objects and libraries\n", stdout);
+	fputs("              and OMF libraries (no ar65 archive).\n", stdout);
+	fputs("  --update library infile...\n", stdout);
+	fputs("              replace or add cc65 objects in an OMF library without\n", stdout);
+	fputs("              converting the other members (outfile defaults to library).\n", stdout);
+	fputs("  --split dir\n", stdout);
+	fputs("              write each library member as its own OMF object in dir.\n", stdout);
+	fputs("  --max-members n, --max-lib-size n[k|m]\n", stdout);
+	fputs("              split the library into outfile1, outfile2, ... within these\n", stdout);
+	fputs("              limits.  Mutually dependent members stay together, and\n", stdout);
+	fputs("              a library only imports from the libraries after it.\n", stdout);
+	fputs("  --dedup\n", stdout);
+	fputs("              store identical library segments once.\n", stdout);
+	fputs("  --shared-equates\n", stdout);
+	fputs("              move constant exports of every member into one EQUATES member.\n", stdout);
+	fputs("  --roots symbol,... | --roots @file\n", stdout);
+	fputs("              only keep library members needed by these symbols.\n", stdout);
+	fputs("  --dependency-graph file\n", stdout);
+	fputs("              write the member dependency graph (DOT, or JSON for .json)\n", stdout);
+	fputs("  --symbol-index\n", stdout);
+	fputs("              also write outfile.idx, a sorted symbol index for --find.\n", stdout);
+	fputs("  --find symbol library...\n", stdout);
+	fputs("              look up symbol in the library indexes (repeatable).\n", stdout);
+	fputs("  --server socket\n", stdout);
+	fputs("              run as a conversion server.  Other invocations with\n", stdout);
+	fputs("              CC65_TO_OMF_SOCKET=socket are forwarded to it.\n", stdout);
+	fatal_exit(ex);
 }
 
+enum {
+	OPT_MD = 256,
+	OPT_MF,
+	OPT_SERVER,
+	OPT_WATCH,
+	OPT_LIST_SYMBOLS,
+	OPT_SYMBOL_INDEX,
+	OPT_FIND,
+	OPT_SORT_DICTIONARY,
+	OPT_ORDER_MEMBERS,
+	OPT_DEPENDENCY_GRAPH,
+	OPT_ROOTS,
+	OPT_FUNCTION_SEGMENTS,
+	OPT_MERGE_SEGMENTS,
+	OPT_DEDUP,
+	OPT_SHARED_EQUATES,
+	OPT_CHECK,
+	OPT_RESOLVE,
+	OPT_SPLIT,
+	OPT_LIBRARY,
+	OPT_MAX_MEMBERS,
+	OPT_MAX_LIB_SIZE,
+	OPT_UPDATE,
+};
 
-int main(int argc, char **argv) {
+static struct option long_options[] = {
+	{ "MD", no_argument, nullptr, OPT_MD },
+	{ "MF", required_argument, nullptr, OPT_MF },
+	{ "server", required_argument, nullptr, OPT_SERVER },
+	{ "watch", no_argument, nullptr, OPT_WATCH },
+	{ "list-symbols", optional_argument, nullptr, OPT_LIST_SYMBOLS },
+	{ "symbol-index", no_argument, nullptr, OPT_SYMBOL_INDEX },
+	{ "find", required_argument, nullptr, OPT_FIND },
+	{ "sort-dictionary", no_argument, nullptr, OPT_SORT_DICTIONARY },
+	{ "order-members", no_argument, nullptr, OPT_ORDER_MEMBERS },
+	{ "dependency-graph", required_argument, nullptr, OPT_DEPENDENCY_GRAPH },
+	{ "roots", required_argument, nullptr, OPT_ROOTS },
+	{ "function-segments", no_argument, nullptr, OPT_FUNCTION_SEGMENTS },
+	{ "merge-segments", no_argument, nullptr, OPT_MERGE_SEGMENTS },
+	{ "dedup", no_argument, nullptr, OPT_DEDUP },
+	{ "shared-equates", no_argument, nullptr, OPT_SHARED_EQUATES },
+	{ "check", no_argument, nullptr, OPT_CHECK },
+	{ "resolve", required_argument, nullptr, OPT_RESOLVE },
+	{ "split", required_argument, nullptr, OPT_SPLIT },
+	{ "library", no_argument, nullptr, OPT_LIBRARY },
+	{ "max-members", required_argument, nullptr, OPT_MAX_MEMBERS },
+	{ "max-lib-size", required_argument, nullptr, OPT_MAX_LIB_SIZE },
+	{ "update", required_argument, nullptr, OPT_UPDATE },
+	{ nullptr, 0, nullptr, 0 }
+};
+
+
+int cc65_to_omf(int argc, char **argv) {
 
 
 	int c;
 	FILE *f;
 
+	std::vector<std::string> args(argv, argv + argc);
 
-	while ((c = getopt(argc, argv, "o:vh")) != -1) {
+	while ((c = getopt_long_only(argc, argv, "o:uvh", long_options, nullptr)) != -1) {
 		switch(c) {
 			case 'h':
 				show_usage(0);
@@ -744,25 +2184,228 @@ int main(int argc, char **argv) {
 			case 'o':
 				outfile = optarg;
 				break;
+			case 'u':
+				flag_u = true;
+				break;
+			case OPT_MD:
+				flag_md = true;
+				break;
+			case OPT_MF:
+				flag_md = true;
+				depfile = optarg;
+				break;
+			case OPT_SERVER:
+				server_path = optarg;
+				break;
+			case OPT_WATCH:
+				flag_watch = true;
+				break;
+			case OPT_LIST_SYMBOLS:
+				flag_list = true;
+				if (optarg) {
+					if (!strcmp(optarg, "json")) flag_json = true;
+					else if (strcmp(optarg, "text")) show_usage(1);
+				}
+				break;
+			case OPT_SYMBOL_INDEX:
+				flag_index = true;
+				digest_option("--symbol-index");
+				break;
+			case OPT_FIND:
+				FindSymbols.emplace_back(optarg);
+				break;
+			case OPT_SORT_DICTIONARY:
+				flag_sort = true;
+				digest_option("--sort-dictionary");
+				break;
+			case OPT_ORDER_MEMBERS:
+				flag_order = true;
+				digest_option("--order-members");
+				break;
+			case OPT_DEPENDENCY_GRAPH:
+				graph_file = optarg;
+				break;
+			case OPT_ROOTS:
+				add_roots(optarg);
+				break;
+			case OPT_FUNCTION_SEGMENTS:
+				flag_function_segments = true;
+				digest_option("--function-segments");
+				break;
+			case OPT_MERGE_SEGMENTS:
+				flag_merge_segments = true;
+				digest_option("--merge-segments");
+				break;
+			case OPT_DEDUP:
+				flag_dedup = true;
+				digest_option("--dedup");
+				break;
+			case OPT_SHARED_EQUATES:
+				flag_shared_equates = true;
+				digest_option("--shared-equates");
+				break;
+			case OPT_CHECK:
+				flag_check = true;
+				break;
+			case OPT_RESOLVE:
+				read_constants(optarg);
+				break;
+			case OPT_SPLIT:
+				split_dir = optarg;
+				digest_option("--split", optarg);
+				break;
+			case OPT_LIBRARY:
+				flag_library = true;
+				digest_option("--library");
+				break;
+			case OPT_MAX_MEMBERS:
+				// file numbers are 16-bit.
+				max_members = parse_count(optarg, 0xffff);
+				digest_option("--max-members", optarg);
+				break;
+			case OPT_MAX_LIB_SIZE:
+				max_lib_size = parse_size(optarg);
+				digest_option("--max-lib-size", optarg);
+				break;
+			case OPT_UPDATE:
+				update_lib = optarg;
+				digest_option("--update", optarg);
+				break;
 			default:
 				show_usage(1);
 		}
 	}
 
+	uint64_t options = options_digest(DigestOptions);
+	cache_options = options;
+
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1) show_usage(1);
+	if (flag_function_segments && flag_merge_segments)
+		fatalx("--function-segments and --merge-segments are mutually exclusive.");
+	// the name sort would undo the member order in the dictionary.
+	if (flag_order && flag_sort)
+		fatalx("--order-members and --sort-dictionary are mutually exclusive.");
+	// the digest is stored on the output, which --split doesn't write.
+	if (split_dir && flag_u)
+		fatalx("-u can't be used with --split.");
+	// nor a library, so the library options would be ignored.
+	if (split_dir && flag_dedup)
+		fatalx("--dedup can't be used with --split.");
+	if (split_dir && flag_index)
+		fatalx("--symbol-index can't be used with --split.");
+	if (split_dir && flag_sort)
+		fatalx("--sort-dictionary can't be used with --split.");
+	if (split_dir && (max_members || max_lib_size))
+		fatalx("--split can't be used with --max-members or --max-lib-size.");
+	if (flag_library && flag_u)
+		fatalx("-u can't be used with --library.");
+	if (update_lib && flag_u)
+		fatalx("-u can't be used with --update.");
+	if (update_lib && flag_library)
+		fatalx("--update and --library are mutually exclusive.");
+	// the library's EQUATES member would be added again, not updated.
+	if (update_lib && flag_shared_equates)
+		fatalx("--shared-equates can't be used with --update.");
+	if ((max_members || max_lib_size) && flag_u)
+		fatalx("-u can't be used with --max-members or --max-lib-size.");
+
+	// options given with --server are the defaults for every request.
+	if (server_path && !in_server) return run_server(server_path);
+	if (flag_watch && in_server)
+		fatalx("--watch can't be forwarded to a server.");
+
+	if (!in_server) {
+		const char *sock = getenv("CC65_TO_OMF_SOCKET");
+		if (sock && *sock) {
+			int rv = run_client(sock, args);
+			if (rv >= 0) return rv;
+		}
+	}
+
+	if (!FindSymbols.empty()) {
+		if (argc < 1) show_usage(1);
+		return find_symbols(FindSymbols, argc, argv);
+	}
+
+	if (flag_list) {
+		if (argc < 1) show_usage(1);
+		return list_symbols(argc, argv, flag_json);
+	}
+
+	if (flag_check) {
+		if (argc < 1) show_usage(1);
+		return check_symbols(argc, argv);
+	}
+
+	if (flag_watch) {
+		if (argc < 1) show_usage(1);
+		flag_cache = true;
+		return run_watch(argc, argv, outfile);
+	}
 
+	if (argc < 1) show_usage(1);
+
+	if (update_lib) {
+		std::vector<std::string> inputs(argv, argv + argc);
+		if (!outfile) outfile = update_lib;
+		process_update(update_lib, inputs);
+		if (flag_md) {
+			std::string path = depfile ? depfile : default_depfile(outfile);
+			inputs.emplace(inputs.begin(), update_lib);
+			write_depfile(path, inputs);
+		}
+		return 0;
+	}
+
+	if (flag_library) {
+		std::vector<std::string> inputs(argv, argv + argc);
+		if (!outfile) outfile = "out.lib";
+		process_objs(inputs);
+		if (flag_md) {
+			std::string path = depfile ? depfile : default_depfile(outfile);
+			write_depfile(path, inputs);
+		}
+		return 0;
+	}
+
+	if (argc > 1) {
+		if (depfile) fatalx("-MF can't be used with more than one input.");
+		return run_batch(argc, argv, outfile, options);
+	}
+
+	infile = argv[0];
 
 	f = fopen(argv[0], "rb");
-	if (!f) err(1, "Unable to open file %s", argv[0]);
+	if (!f) fatal("Unable to open file %s", argv[0]);
+
+	close_on_error(f, [&](){
+		int type = file_type(f);
+		if (!outfile) outfile = type ? "out.lib" : "out.omf";
+
+		if (flag_u && up_to_date(argv[0], outfile, options)) {
+			if (flag_v) printf("%s is up to date\n", outfile);
+			Outputs.emplace_back(outfile);
+		} else {
+			switch(type) {
+				case 0: process_obj(f, true); break;
+				case 1: process_lib(f); break;
+			}
+			if (flag_u) save_digest(argv[0], outfile, options);
+		}
+	});
+	fclose(f);
 
-	switch(file_type(f)) {
-		case 0: process_obj(f, true); break;
-		case 1: process_lib(f); break;
+	if (flag_md) {
+		std::string path = depfile ? depfile : default_depfile(outfile);
+		write_depfile(path, { argv[0] });
 	}
 
 
 	return 0;
-} 
\ No newline at end of file
+}
+
+int main(int argc, char **argv) {
+	return cc65_to_omf(argc, argv);
+}
@@ -0,0 +1,469 @@
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <err.h>
+
+#include "to_omf.h"
+
+/*
+
+OMF library reader.
+
+An OMF library ($B2) is a LIBRARY segment (kind $08) followed by the
+member segments.  The LIBRARY segment holds 3 lconst records (see
+process_members):
+
+1. file names - { uint16_t file number, pstring name }*
+2. symbols    - { uint32_t name offset, uint16_t file number,
+                  uint16_t private, uint32_t segment offset in the library }*
+3. names      - pstring*
+
+Every dictionary entry points at a segment, which is how segments are
+assigned to members.  A segment that several members point at (written
+by an earlier --dedup) goes to the first of them only, so its exports
+aren't defined twice.  Segment bodies are kept as is; export offsets and
+imports are recovered by walking the records.
+
+Only version 2 segments with 4 byte numbers and variable length labels
+are supported, and interseg records are rejected since the segment
+numbers change when the members are rewritten.  Segments are rewritten
+as private with no alignment or org, like converted segments.
+
+*/
+
+namespace {
+
+	uint32_t get_32(const uint8_t *cp) {
+		return cp[0] | (cp[1] << 8) | (cp[2] << 16) | ((uint32_t)cp[3] << 24);
+	}
+
+	uint16_t get_16(const uint8_t *cp) {
+		return cp[0] | (cp[1] << 8);
+	}
+
+	struct omf_segment {
+		std::string_view name;
+		uint32_t length = 0;
+		unsigned kind = 0;
+		size_t data = 0; // body offset
+		size_t end = 0;
+		uint32_t org = 0;
+		uint32_t align = 0;
+	};
+
+	class omf_reader {
+	public:
+		omf_reader(const std::string &p, const std::vector<uint8_t> &d) : path(p), data(d)
+		{}
+
+		void header(size_t offset, omf_segment &seg);
+		void scan(const omf_segment &seg);
+
+		// GLOBAL/ENTRY offsets, labels defined and labels referenced by the
+		// last scan().
+		std::unordered_map<const char *, uint32_t> globals;
+		std::unordered_set<const char *> defined;
+		std::vector<std::string_view> referenced;
+
+		const std::string &path;
+		const std::vector<uint8_t> &data;
+
+	private:
+		[[noreturn]] void bad(size_t offset, const char *what) {
+			fatalx("%s: %s at $%06lx", path.c_str(), what, (unsigned long)offset);
+		}
+
+		void need(size_t offset, size_t n, size_t end) {
+			if (offset + n > end) bad(offset, "Truncated record");
+		}
+
+		std::string_view label(size_t &offset, size_t end);
+		void expression(size_t &offset, size_t end);
+	};
+
+
+	void omf_reader::header(size_t offset, omf_segment &seg) {
+
+		if (offset + 48 > data.size()) bad(offset, "Truncated segment header");
+		const uint8_t *cp = data.data() + offset;
+
+		uint32_t bytecnt = get_32(cp + 0);
+		unsigned lablen = cp[13];
+		unsigned numlen = cp[14];
+		unsigned version = cp[15];
+		unsigned dispname = get_16(cp + 40);
+		unsigned dispdata = get_16(cp + 42);
+
+		bool ok = version == 2 && numlen == 4 && bytecnt >= dispdata
+			&& offset + bytecnt <= data.size() && dispname + 10 < dispdata;
+		if (!ok) bad(offset, "Unsupported or bad OMF segment");
+		// segments are written back with variable length labels.
+		if (lablen) bad(offset, "Fixed length labels are not supported");
+
+		seg.length = get_32(cp + 8);
+		seg.kind = get_16(cp + 20);
+		seg.org = get_32(cp + 24);
+		seg.align = get_32(cp + 28);
+		seg.data = offset + dispdata;
+		seg.end = offset + bytecnt;
+
+		size_t n = offset + dispname + 10;
+		seg.name = label(n, offset + dispdata);
+	}
+
+	std::string_view omf_reader::label(size_t &offset, size_t end) {
+		need(offset, 1, end);
+		size_t n = data[offset++];
+		need(offset, n, end);
+		const char *cp = reinterpret_cast<const char *>(data.data() + offset);
+		offset += n;
+		return intern(std::string_view(cp, n));
+	}
+
+	void omf_reader::expression(size_t &offset, size_t end) {
+		for (;;) {
+			need(offset, 1, end);
+			unsigned op = data[offset++];
+			if (op == 0x00) return;
+			if (op <= 0x15 || op == 0x80) continue; // operators, location counter
+
+			switch (op) {
+				case 0x81: // abs
+				case 0x87: // rel
+					need(offset, 4, end);
+					offset += 4;
+					break;
+				case 0x82: // weak
+				case 0x83: // label
+				case 0x84: // length
+				case 0x85: // type
+				case 0x86: // count
+					referenced.push_back(label(offset, end));
+					break;
+				default:
+					bad(offset - 1, "Bad expression operator");
+			}
+		}
+	}
+
+	void omf_reader::scan(const omf_segment &seg) {
+
+		globals.clear();
+		defined.clear();
+		referenced.clear();
+
+		size_t offset = seg.data;
+		size_t end = seg.end;
+		uint32_t pc = 0;
+
+		auto define = [&](size_t &offset, bool global) {
+			auto name = label(offset, end);
+			need(offset, 4, end);
+			offset += 4; // length, type, private
+			defined.insert(name.data());
+			if (global) globals.emplace(name.data(), pc);
+			return name;
+		};
+
+		while (offset < end) {
+			unsigned op = data[offset++];
+			if (op == 0x00) return;
+
+			if (op <= 0xdf) { // const
+				need(offset, op, end);
+				offset += op;
+				pc += op;
+				continue;
+			}
+
+			switch(op) {
+				case 0xe0: // align
+				case 0xe1: // org
+					need(offset, 4, end);
+					offset += 4;
+					break;
+				case 0xe2: // reloc
+					offset += 10;
+					break;
+				case 0xe3: // interseg
+				case 0xf6: // cinterseg
+					bad(offset - 1, "Interseg records are not supported");
+				case 0xe4: // using
+				case 0xe5: // strong
+					referenced.push_back(label(offset, end));
+					break;
+				case 0xe6: // global
+					define(offset, true);
+					break;
+				case 0xef: // local
+					define(offset, false);
+					break;
+				case 0xe7: // gequ
+				case 0xf0: // equ
+					define(offset, false);
+					expression(offset, end);
+					break;
+				case 0xe8: // mem
+					offset += 8;
+					break;
+				case 0xeb: // expr
+				case 0xec: // zexpr
+				case 0xed: // bexpr
+				case 0xf3: // lexpr
+					need(offset, 1, end);
+					pc += data[offset++];
+					expression(offset, end);
+					break;
+				case 0xee: // relexpr
+					need(offset, 5, end);
+					pc += data[offset];
+					offset += 5;
+					expression(offset, end);
+					break;
+				case 0xf1: // ds
+					need(offset, 4, end);
+					pc += get_32(data.data() + offset);
+					offset += 4;
+					break;
+				case 0xf2: { // lconst
+					need(offset, 4, end);
+					uint32_t n = get_32(data.data() + offset);
+					offset += 4;
+					need(offset, n, end);
+					offset += n;
+					pc += n;
+					break;
+				}
+				case 0xf4: { // entry - segment number, value, name
+					need(offset, 6, end);
+					uint32_t value = get_32(data.data() + offset + 2);
+					offset += 6;
+					auto name = label(offset, end);
+					defined.insert(name.data());
+					globals.emplace(name.data(), value);
+					break;
+				}
+				case 0xf5: // creloc
+					offset += 6;
+					break;
+				default:
+					bad(offset - 1, "Unsupported OMF record");
+			}
+			if (offset > end) bad(offset, "Truncated record");
+		}
+		bad(offset, "Missing end of segment");
+	}
+}
+
+
+// an OMF library starts with a version 2 LIBRARY segment.
+bool is_omf_library(FILE *f) {
+
+	uint8_t header[48];
+	long pos = ftell(f);
+	size_t n = fread(header, 1, sizeof(header), f);
+	fseek(f, pos, SEEK_SET);
+
+	if (n != sizeof(header)) return false;
+	return header[15] == 2 && header[14] == 4 && (get_16(header + 20) & 0x1f) == 0x08;
+}
+
+
+// exact: every segment and dictionary entry must be written back as it was
+// (--update writes over the library).
+void read_omf_library(const std::string &path, std::vector<file> &files, bool exact) {
+
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) fatal("Unable to open file %s", path.c_str());
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	std::vector<uint8_t> data(size > 0 ? size : 0);
+	if (fread(data.data(), 1, data.size(), f) != data.size())
+		fatal("Unable to read %s", path.c_str());
+	fclose(f);
+
+	omf_reader r(path, data);
+
+	omf_segment lib;
+	r.header(0, lib);
+	if ((lib.kind & 0x1f) != 0x08)
+		fatalx("%s: not an OMF library", path.c_str());
+
+	// the 3 lconsts.
+	const uint8_t *lc[3];
+	uint32_t lc_size[3];
+	size_t offset = lib.data;
+	for (unsigned i = 0; i < 3; ++i) {
+		if (offset + 5 > lib.end || r.data[offset] != 0xf2)
+			fatalx("%s: bad LIBRARY segment", path.c_str());
+		lc_size[i] = get_32(r.data.data() + offset + 1);
+		lc[i] = r.data.data() + offset + 5;
+		offset += 5 + lc_size[i];
+		if (offset > lib.end)
+			fatalx("%s: bad LIBRARY segment", path.c_str());
+	}
+
+	// 1. file names.
+	std::map<unsigned, unsigned> numbers; // file number -> files index
+	size_t first = files.size();
+	for (uint32_t i = 0; i + 3 <= lc_size[0]; ) {
+		unsigned number = get_16(lc[0] + i);
+		unsigned n = lc[0][i + 2];
+		if (i + 3 + n > lc_size[0]) break;
+
+		file mf;
+		mf.number = number;
+		mf.name.assign(reinterpret_cast<const char *>(lc[0] + i + 3), n);
+		numbers[number] = files.size();
+		files.emplace_back(std::move(mf));
+		i += 3 + n;
+	}
+
+	// 2. and 3. symbols, grouped by member and segment.
+	struct entry {
+		std::string_view name;
+		bool priv;
+	};
+	std::vector<std::map<uint32_t, std::vector<entry>>> members(files.size() - first);
+
+	if (lc_size[1] % 12) fatalx("%s: bad symbol table", path.c_str());
+	for (uint32_t i = 0; i < lc_size[1]; i += 12) {
+		const uint8_t *cp = lc[1] + i;
+		uint32_t name = get_32(cp);
+		unsigned number = get_16(cp + 4);
+		bool priv = get_16(cp + 6);
+		uint32_t address = get_32(cp + 8);
+
+		if (name >= lc_size[2] || name + 1 + lc[2][name] > lc_size[2])
+			fatalx("%s: bad symbol name offset", path.c_str());
+		auto iter = numbers.find(number);
+		if (iter == numbers.end())
+			fatalx("%s: bad file number %u", path.c_str(), number);
+
+		std::string_view s(reinterpret_cast<const char *>(lc[2] + name + 1), lc[2][name]);
+		members[iter->second - first][address].push_back({ intern(s), priv });
+	}
+
+	// segments, in library order.
+	std::unordered_set<uint32_t> loaded;
+	for (unsigned m = 0; m < members.size(); ++m) {
+		auto &mf = files[first + m];
+		std::unordered_set<const char *> defined;
+		std::vector<std::string_view> referenced;
+		std::vector<std::vector<std::string_view>> segment_refs;
+
+		for (const auto &kv : members[m]) {
+			// shared with an earlier member.
+			if (!loaded.insert(kv.first).second) {
+				if (exact)
+					fatalx("%s: %s shares a segment with another member (rebuild the library with --library)",
+						path.c_str(), mf.name.c_str());
+				continue;
+			}
+
+			omf_segment os;
+			r.header(kv.first, os);
+			r.scan(os);
+
+			if (os.org || os.align) {
+				if (exact)
+					fatalx("%s: %s: segment %s has an org or alignment",
+						path.c_str(), mf.name.c_str(), std::string(os.name).c_str());
+				warnx("%s: segment %s: org and alignment are not preserved",
+					path.c_str(), std::string(os.name).c_str());
+			}
+
+			segment seg;
+			seg.name = os.name;
+			seg.size = os.length;
+			seg.omf_kind = os.kind & ~0x4000;
+			seg.omf.assign(r.data.begin() + os.data, r.data.begin() + os.end);
+
+			bool named = false;
+			for (const auto &e : kv.second) {
+				// the segment name itself.
+				if (e.priv && !named && e.name == seg.name) {
+					named = true;
+					continue;
+				}
+				export_sym ex;
+				ex.name = e.name;
+				ex.priv = e.priv;
+				auto iter = r.globals.find(e.name.data());
+				if (iter != r.globals.end()) ex.offset = iter->second;
+				seg.exports.emplace_back(std::move(ex));
+			}
+
+			if (exact) {
+				// byte for byte, keeping the segment number.
+				std::vector<uint8_t> tmp;
+				save_omf_segment(tmp, seg, get_16(r.data.data() + kv.first + 34));
+				bool same = tmp.size() == os.end - kv.first
+					&& std::equal(tmp.begin(), tmp.end(), r.data.begin() + kv.first);
+				if (!same || !named)
+					fatalx("%s: %s: segment %s can't be rewritten exactly",
+						path.c_str(), mf.name.c_str(), std::string(seg.name).c_str());
+			}
+
+			defined.insert(seg.name.data());
+			defined.insert(r.defined.begin(), r.defined.end());
+			for (const auto &e : seg.exports) defined.insert(e.name.data());
+			referenced.insert(referenced.end(), r.referenced.begin(), r.referenced.end());
+			segment_refs.push_back(r.referenced);
+
+			mf.segments.emplace_back(std::move(seg));
+		}
+
+		// segments that refer to other segments by name can't be shared (--dedup).
+		std::unordered_set<const char *> names;
+		for (const auto &seg : mf.segments) names.insert(seg.name.data());
+		for (unsigned i = 0; i < mf.segments.size(); ++i) {
+			auto &seg = mf.segments[i];
+			for (const auto &name : segment_refs[i]) {
+				if (name != seg.name && names.count(name.data())) seg.section_labels = true;
+			}
+		}
+
+		std::unordered_set<const char *> seen;
+		for (const auto &name : referenced) {
+			if (defined.count(name.data())) continue;
+			if (seen.insert(name.data()).second) mf.imports.push_back(name);
+		}
+	}
+
+	// segments no member points at would be dropped.
+	if (exact) {
+		for (size_t offset = lib.end; offset < r.data.size(); ) {
+			omf_segment os;
+			r.header(offset, os);
+			if (!loaded.count(offset))
+				fatalx("%s: segment %s at $%06lx isn't in the dictionary",
+					path.c_str(), std::string(os.name).c_str(), (unsigned long)offset);
+			offset = os.end;
+		}
+	}
+}
+
+
+// labels referenced by a (converted) segment body.
+void omf_references(const segment &seg, std::vector<std::string_view> &names) {
+
+	omf_segment os;
+	os.name = seg.name;
+	os.end = seg.omf.size();
+
+	std::string path(seg.name);
+	omf_reader r(path, seg.omf);
+	r.scan(os);
+	names = std::move(r.referenced);
+}
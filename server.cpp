@@ -0,0 +1,399 @@
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <err.h>
+
+#include "to_omf.h"
+
+/*
+
+Conversion server.
+
+--server path listens on a UNIX domain socket.  A client (any invocation
+with CC65_TO_OMF_SOCKET set in the environment) forwards its working
+directory and arguments, along with its stdout and stderr descriptors,
+and waits for the exit status.
+
+Requests are handled in the server process, so the member cache carries
+over: library members that haven't changed since an earlier request
+aren't converted again.  Each request starts from the server's own
+options and runs in the client's directory with its stdout and stderr,
+so diagnostics go directly to the client's terminal.  Fatal errors end
+the request rather than the server (see flag_recover).
+
+The cache, the working directory and the stdout/stderr redirection are
+process-wide, so the server runs one request at a time.  A client that
+finds it busy is told so at once and converts locally instead, so
+parallel builds aren't serialized behind the server.
+
+request:  uint32_t length, cwd \0 argv[0] \0 ... argv[n-1] \0
+          + SCM_RIGHTS { stdout, stderr }
+response: uint32_t exit status, or busy_status
+
+*/
+
+bool in_server = false;
+
+#if defined(_WIN32)
+
+int run_server(const char *path) {
+	errx(1, "--server is not supported on this platform.");
+	return 1;
+}
+
+int run_client(const char *path, const std::vector<std::string> &args) {
+	return -1;
+}
+
+#else
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+namespace {
+
+	const uint32_t busy_status = 0xffffffff;
+
+	bool make_address(const char *path, struct sockaddr_un &addr) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(path) >= sizeof(addr.sun_path)) return false;
+		strcpy(addr.sun_path, path);
+		return true;
+	}
+
+	bool read_all(int fd, void *data, size_t size) {
+		auto cp = static_cast<uint8_t *>(data);
+		while (size) {
+			ssize_t n = read(fd, cp, size);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			cp += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	bool write_all(int fd, const void *data, size_t size) {
+		auto cp = static_cast<const uint8_t *>(data);
+		while (size) {
+			ssize_t n = write(fd, cp, size);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			cp += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	bool send_status(int fd, int status) {
+		uint8_t data[4];
+		data[0] = status;
+		data[1] = status >> 8;
+		data[2] = status >> 16;
+		data[3] = status >> 24;
+		return write_all(fd, data, 4);
+	}
+
+
+	// read the request header (and the client's stdout/stderr)
+	bool read_request(int fd, std::vector<std::string> &strings, int fds[2]) {
+
+		uint8_t header[4];
+		union {
+			struct cmsghdr align;
+			char buffer[CMSG_SPACE(2 * sizeof(int))];
+		} control;
+
+		struct iovec iov = { header, sizeof(header) };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+
+		ssize_t n;
+		do {
+			n = recvmsg(fd, &msg, 0);
+		} while (n < 0 && errno == EINTR);
+		if (n <= 0) return false;
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+			|| cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+			return false;
+		memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+		if (n < 4 && !read_all(fd, header + n, 4 - n)) return false;
+
+		uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16) | (header[3] << 24);
+		if (size > 0x100000) return false;
+
+		std::vector<char> data(size);
+		if (!read_all(fd, data.data(), size)) return false;
+		if (size == 0 || data.back() != 0) return false;
+
+		for (auto cp = data.data(), end = cp + size; cp < end; ) {
+			strings.emplace_back(cp);
+			cp += strings.back().size() + 1;
+		}
+		return strings.size() >= 2; // cwd + argv[0]
+	}
+
+	int run_request(std::vector<std::string> &strings, int fds[2]) {
+
+		int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (cwd < 0) {
+			dprintf(fds[1], "cc65-to-omf: server: %s\n", strerror(errno));
+			return 1;
+		}
+		if (chdir(strings.front().c_str()) < 0) {
+			dprintf(fds[1], "cc65-to-omf: Unable to chdir to %s: %s\n",
+				strings.front().c_str(), strerror(errno));
+			close(cwd);
+			return 1;
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		int saved[2] = { dup(1), dup(2) };
+		dup2(fds[0], 1);
+		dup2(fds[1], 2);
+
+		std::vector<char *> argv;
+		for (size_t i = 1; i < strings.size(); ++i)
+			argv.push_back(&strings[i][0]);
+		argv.push_back(nullptr);
+
+		// restart getopt.
+	#if defined(__GLIBC__)
+		optind = 0;
+	#else
+		optreset = 1;
+		optind = 1;
+	#endif
+
+		restore_options();
+		flag_recover = true;
+
+		int status;
+		try {
+			status = cc65_to_omf(argv.size() - 1, argv.data());
+		} catch (const fatal_error &e) {
+			status = e.status;
+		}
+		reset();
+
+		fflush(stdout);
+		fflush(stderr);
+		dup2(saved[0], 1);
+		dup2(saved[1], 2);
+		close(saved[0]);
+		close(saved[1]);
+
+		if (fchdir(cwd) < 0) err(1, "Unable to restore the working directory");
+		close(cwd);
+		return status;
+	}
+
+	// busy: read the request (so the client isn't cut off mid-write) and
+	// send it back to convert locally.
+	void handle_client(int fd, bool busy) {
+
+		std::vector<std::string> strings;
+		int fds[2] = { -1, -1 };
+
+		// a stuck client shouldn't hold up the others.
+		struct timeval tv = { 10, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		if (read_request(fd, strings, fds))
+			send_status(fd, busy ? busy_status : run_request(strings, fds));
+		if (fds[0] >= 0) close(fds[0]);
+		if (fds[1] >= 0) close(fds[1]);
+		close(fd);
+	}
+
+	// the request being run.
+	std::mutex mutex;
+	std::condition_variable cv;
+	int pending = -1;
+	bool busy = false;
+
+	void run_requests() {
+		for(;;) {
+			int fd;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [](){ return pending >= 0; });
+				fd = pending;
+				pending = -1;
+			}
+			handle_client(fd, false);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				busy = false;
+			}
+		}
+	}
+
+}
+
+int run_server(const char *path) {
+
+	struct sockaddr_un addr;
+
+	if (!make_address(path, addr))
+		errx(1, "Socket path too long: %s", path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) err(1, "socket");
+
+	// only replace a stale socket, never some other file.
+	struct stat st;
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			errx(1, "%s exists and is not a socket", path);
+		unlink(path);
+	}
+
+	// requests write files as this user, so only this user may connect.
+	mode_t mask = umask(077);
+	int ok = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ok < 0)
+		err(1, "Unable to bind %s", path);
+	if (chmod(path, 0600) < 0)
+		err(1, "Unable to chmod %s", path);
+	if (listen(sock, 64) < 0)
+		err(1, "listen");
+
+	signal(SIGPIPE, SIG_IGN);
+	in_server = true;
+	flag_cache = true;
+	save_options();
+
+	std::thread(run_requests).detach();
+
+	for(;;) {
+		int fd = accept(sock, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			err(1, "accept");
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (busy) {
+			lock.unlock();
+			std::thread(handle_client, fd, true).detach();
+			continue;
+		}
+		busy = true;
+		pending = fd;
+		lock.unlock();
+		cv.notify_one();
+	}
+	return 0;
+}
+
+// returns -1 if the server is unavailable or busy.
+int run_client(const char *path, const std::vector<std::string> &args) {
+
+	struct sockaddr_un addr;
+	std::vector<uint8_t> data;
+	int fds[2] = { 1, 2 };
+	char *cwd;
+
+	if (!make_address(path, addr)) return -1;
+
+	cwd = getcwd(nullptr, 0);
+	if (!cwd) return -1;
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		free(cwd);
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		free(cwd);
+		close(sock);
+		return -1;
+	}
+
+	push_back_32(data, 0);
+	data.insert(data.end(), cwd, cwd + strlen(cwd) + 1);
+	for (const auto &s : args)
+		data.insert(data.end(), s.c_str(), s.c_str() + s.size() + 1);
+	free(cwd);
+
+	uint32_t size = data.size() - 4;
+	data[0] = size;
+	data[1] = size >> 8;
+	data[2] = size >> 16;
+	data[3] = size >> 24;
+
+
+	union {
+		struct cmsghdr align;
+		char buffer[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct iovec iov = { data.data(), data.size() };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	fflush(stdout);
+	fflush(stderr);
+
+	ssize_t n;
+	do {
+		n = sendmsg(sock, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) {
+		close(sock);
+		return -1;
+	}
+
+	if (!write_all(sock, data.data() + n, data.size() - n))
+		errx(1, "Lost connection to server %s", path);
+
+	uint8_t status[4];
+	if (!read_all(sock, status, 4))
+		errx(1, "Lost connection to server %s", path);
+	close(sock);
+
+	uint32_t rv = status[0] | (status[1] << 8) | (status[2] << 16) | ((uint32_t)status[3] << 24);
+	if (rv == busy_status) return -1;
+	return rv;
+}
+
+#endif
@@ -0,0 +1,222 @@
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <err.h>
+
+#include "exprdefs.h"
+#include "fileio.h"
+#include "libdefs.h"
+#include "objdefs.h"
+#include "symdefs.h"
+
+#include "to_omf.h"
+
+/*
+
+Symbol listing.
+
+Only the string pool, import list and export list are read -- segments,
+fragments and expressions are never converted.
+
+*/
+
+namespace {
+
+	enum {
+		LEAF_LITERAL = 1,
+		LEAF_SYMBOL = 2,
+		LEAF_SECTION = 4,
+	};
+
+	// skip an expression, returning the kinds of leaves it contains.
+	unsigned skip_expr(FILE *f) {
+
+		unsigned op = Read8(f);
+		if (op == EXPR_NULL) return 0;
+
+		if ((op & EXPR_TYPEMASK) == EXPR_LEAFNODE) {
+			switch(op) {
+				case EXPR_LITERAL:
+					Read32(f);
+					return LEAF_LITERAL;
+				case EXPR_SYMBOL:
+					ReadVar(f);
+					return LEAF_SYMBOL;
+				case EXPR_SECTION:
+					ReadVar(f);
+					return LEAF_SECTION;
+				default:
+					fatalx("Bad leaf node: $%02x", op);
+			}
+		}
+
+		// unary nodes have a NULL right side.
+		unsigned rv = skip_expr(f);
+		rv |= skip_expr(f);
+		return rv;
+	}
+
+	void read_pool(FILE *f, std::vector<std::string> &pool) {
+		unsigned count = ReadVar(f);
+		pool.reserve(count);
+		for (unsigned i = 0; i < count; ++i)
+			pool.emplace_back(ReadString(f));
+	}
+
+	const std::string &pool_string(const std::vector<std::string> &pool, unsigned nm) {
+		if (nm >= pool.size()) fatalx("Bad string index: %u", nm);
+		return pool[nm];
+	}
+
+	void json_string(FILE *out, const std::string &s) {
+		fputc('"', out);
+		for (unsigned char c : s) {
+			if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+			else if (c < 0x20) fprintf(out, "\\u%04x", c);
+			else fputc(c, out);
+		}
+		fputc('"', out);
+	}
+}
+
+
+// read the imports and exports of the object at the current position.
+void read_object_symbols(FILE *f, object_symbols &os) {
+
+	ObjHeader h;
+	std::vector<std::string> pool;
+
+	long base = ftell(f);
+	read_obj_header(f, h);
+
+	fseek(f, base + h.StrPoolOffs, SEEK_SET);
+	read_pool(f, pool);
+
+	fseek(f, base + h.ImportOffs, SEEK_SET);
+	unsigned count = ReadVar(f);
+	os.imports.reserve(count);
+	for (unsigned i = 0; i < count; ++i) {
+		Read8(f); // address size
+		unsigned nm = ReadVar(f);
+		os.imports.emplace_back(pool_string(pool, nm));
+		skip_info_list(f);
+		skip_info_list(f);
+	}
+
+	fseek(f, base + h.ExportOffs, SEEK_SET);
+	count = ReadVar(f);
+	os.exports.reserve(count);
+	for (unsigned i = 0; i < count; ++i) {
+		unsigned type = ReadVar(f);
+		Read8(f); // address size
+
+		// constructor/destructor priorities.
+		for (unsigned j = 0; j < SYM_GET_CONDES_COUNT(type); ++j)
+			Read8(f);
+
+		unsigned nm = ReadVar(f);
+
+		symbol_export ex;
+		ex.name = pool_string(pool, nm);
+
+		if (type & SYM_EXPR) {
+			unsigned leaves = skip_expr(f);
+			if (leaves & LEAF_SECTION) ex.type = 'T';
+			else if (leaves & LEAF_SYMBOL) ex.type = 'I';
+			else ex.type = 'A';
+		} else {
+			Read32(f);
+			ex.type = 'A';
+		}
+
+		if (type & SYM_SIZE)
+			ReadVar(f);
+
+		skip_info_list(f);
+		skip_info_list(f);
+
+		os.exports.emplace_back(std::move(ex));
+	}
+}
+
+// read an object or every member of a library.
+void read_file_symbols(const std::string &path, std::vector<object_symbols> &rv) {
+
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) fatal("Unable to open file %s", path.c_str());
+
+	close_on_error(f, [&](){
+		if (file_type(f) == 0) {
+			object_symbols os;
+			os.file = path;
+			read_object_symbols(f, os);
+			rv.emplace_back(std::move(os));
+		} else {
+			std::vector<lib_member> members;
+			read_lib_index(f, members);
+
+			for (auto &m : members) {
+				object_symbols os;
+				os.file = path;
+				os.member = std::move(m.name);
+				fseek(f, m.offset, SEEK_SET);
+				read_object_symbols(f, os);
+				rv.emplace_back(std::move(os));
+			}
+		}
+	});
+	fclose(f);
+}
+
+
+int list_symbols(int argc, char **argv, bool json) {
+
+	bool first = true;
+
+	if (json) fputs("[\n", stdout);
+
+	for (int i = 0; i < argc; ++i) {
+		std::vector<object_symbols> objects;
+		read_file_symbols(argv[i], objects);
+
+		for (const auto &os : objects) {
+			if (json) {
+				if (!first) fputs(",\n", stdout);
+				fputs("  { \"file\": ", stdout);
+				json_string(stdout, os.file);
+				if (!os.member.empty()) {
+					fputs(", \"member\": ", stdout);
+					json_string(stdout, os.member);
+				}
+				fputs(",\n    \"imports\": [", stdout);
+				for (size_t j = 0; j < os.imports.size(); ++j) {
+					if (j) fputs(", ", stdout);
+					json_string(stdout, os.imports[j]);
+				}
+				fputs("],\n    \"exports\": [", stdout);
+				for (size_t j = 0; j < os.exports.size(); ++j) {
+					if (j) fputs(", ", stdout);
+					fputs("{ \"name\": ", stdout);
+					json_string(stdout, os.exports[j].name);
+					fprintf(stdout, ", \"type\": \"%c\" }", os.exports[j].type);
+				}
+				fputs("] }", stdout);
+			} else {
+				if (!first) fputc('\n', stdout);
+				if (os.member.empty()) printf("%s:\n", os.file.c_str());
+				else printf("%s(%s):\n", os.file.c_str(), os.member.c_str());
+				for (const auto &s : os.imports)
+					printf("U %s\n", s.c_str());
+				for (const auto &e : os.exports)
+					printf("%c %s\n", e.type, e.name.c_str());
+			}
+			first = false;
+		}
+	}
+
+	if (json) fputs(first ? "]\n" : "\n]\n", stdout);
+	return 0;
+}
@@ -0,0 +1,207 @@
+# writes the cc65 objects and ar65 libraries tests/run.sh converts.
+#
+#   python3 objects.py dir
+
+import os, struct, sys
+
+def var(n):
+    out = bytearray()
+    while True:
+        b = n & 0x7f; n >>= 7
+        if n: out.append(b | 0x80)
+        else: out.append(b); break
+    return bytes(out)
+
+def vstr(s):
+    s = s.encode(); return var(len(s)) + s
+
+OBJ_MAGIC = 0x616E7A55
+LIB_MAGIC = 0x7A55616E
+
+EXPR_LITERAL = 0x81; EXPR_SYMBOL = 0x82; EXPR_SECTION = 0x83
+PLUS = 0x01; DIV = 0x04; MOD = 0x05; SHL = 0x09; SHR = 0x0A; BYTE1 = 0x49
+
+def lit(v): return bytes([EXPR_LITERAL]) + struct.pack('<I', v & 0xffffffff)
+def sym(i): return bytes([EXPR_SYMBOL]) + var(i)
+def sec(i): return bytes([EXPR_SECTION]) + var(i)
+def binary(op, l, r): return bytes([op]) + l + r
+def unary(op, l): return bytes([op]) + l + b'\0'
+
+class Obj:
+    def __init__(self):
+        self.strings = []; self.imports = []; self.exports = []; self.segs = []; self.procs = []
+
+    def string(self, s):
+        if s not in self.strings: self.strings.append(s)
+        return self.strings.index(s)
+
+    def imp(self, name):
+        self.imports.append(self.string(name)); return len(self.imports) - 1
+
+    # fragments: ('lit', bytes) | ('fill', n) | ('expr', size, expression)
+    def seg(self, name, frags, addrsize=2):
+        self.segs.append((self.string(name), frags, addrsize)); return len(self.segs) - 1
+
+    def export_label(self, name, secno, offset):
+        e = sec(secno) if offset == 0 else binary(PLUS, sec(secno), lit(offset))
+        self.exports.append((0x10 | 0x20 | 0x80, self.string(name), e))
+
+    def export_const(self, name, value):
+        self.exports.append((0x80, self.string(name), struct.pack('<I', value)))
+
+    def export_expr(self, name, e):
+        self.exports.append((0x10 | 0x80, self.string(name), e))
+
+    # a .proc scope (as ca65 -g writes it) with one span.
+    def proc(self, name, secno, offset, size):
+        self.procs.append((self.string(name), secno, offset, size))
+
+    def build(self):
+        segs = var(len(self.segs))
+        for name, frags, addrsize in self.segs:
+            fb = bytearray(); pc = 0
+            for f in frags:
+                if f[0] == 'lit': fb += bytes([0x00]) + var(len(f[1])) + f[1]; pc += len(f[1])
+                elif f[0] == 'fill': fb += bytes([0x20]) + var(f[1]); pc += f[1]
+                elif f[0] == 'expr': fb += bytes([0x08 | f[1]]) + f[2]; pc += f[1]
+                fb += var(0) # line infos
+            body = var(name) + var(0) + var(pc) + var(1) + bytes([addrsize]) + var(len(frags)) + fb
+            segs += struct.pack('<I', len(body)) + body
+        imports = var(len(self.imports))
+        for i in self.imports: imports += bytes([2]) + var(i) + var(0) + var(0)
+        exports = var(len(self.exports))
+        for t, name, v in self.exports: exports += var(t) + bytes([2]) + var(name) + v + var(0) + var(0)
+        strings = var(len(self.strings)) + b''.join(vstr(s) for s in self.strings)
+        empty = var(0)
+        scopes = var(len(self.procs)); spans = var(len(self.procs))
+        for i, (name, secno, offset, size) in enumerate(self.procs):
+            # parent, level, flags (size, labeled), type (scope), name, size, label, spans.
+            scopes += var(0) + var(1) + var(3) + var(2) + var(name) + var(size) + var(0) + var(1) + var(i)
+            spans += var(secno) + var(offset) + var(size) + var(0)
+        # options, files, segments, imports, exports, debug symbols, line
+        # infos, strings, assertions, scopes, spans.
+        tables = [empty, empty, segs, imports, exports, empty, empty, strings, empty, scopes, spans]
+        offset = 96; header = []; data = bytearray()
+        for t in tables: header += [offset + len(data), len(t)]; data += t
+        return struct.pack('<IHH', OBJ_MAGIC, 0x11, 0) + struct.pack('<22I', *header) + bytes(data)
+
+def library(members):
+    data = bytearray(struct.pack('<IHHI', LIB_MAGIC, 0x0D, 0, 0))
+    index = var(len(members))
+    for name, b in members:
+        offset = len(data); data += b
+        index += vstr(name) + struct.pack('<HIII', 0, 0, offset, len(b))
+    index_offset = len(data); data += index
+    data[8:12] = struct.pack('<I', index_offset)
+    return bytes(data)
+
+# CODE, RODATA and BSS referring to each other by section, a constant and
+# an exported expression.
+def sample(prefix, imports):
+    o = Obj()
+    i0 = o.imp(imports[0]); i1 = o.imp(imports[1]) if len(imports) > 1 else None
+    o.seg('CODE', [('lit', b'\xa9\x01'), ('expr', 2, sym(i0)), ('lit', b'\x60'),
+                   ('lit', b'\x20'), ('expr', 2, sec(0)), ('lit', b'\xad'), ('expr', 2, binary(PLUS, sec(1), lit(1))),
+                   ('lit', b'\x60'), ('expr', 1, unary(BYTE1, sec(1)))])
+    o.seg('RODATA', [('lit', b'hello\0'), ('expr', 2, sec(0))])
+    o.seg('BSS', [('fill', 16)])
+    o.export_label(prefix + 'start', 0, 0)
+    o.export_label(prefix + 'second', 0, 4)
+    o.export_label(prefix + 'msg', 1, 0)
+    o.export_const(prefix + 'CONST', 0x1234)
+    if i1 is not None:
+        o.export_expr(prefix + 'alias', binary(PLUS, sym(i1), lit(2)))
+    return o.build()
+
+# jsl to an import, for --resolve.
+def romcall():
+    o = Obj()
+    i = o.imp('ROMCALL')
+    o.seg('CODE', [('lit', b'\x22'), ('expr', 3, sym(i)), ('lit', b'\x6b')])
+    o.export_label('call', 0, 0)
+    return o.build()
+
+# expressions --resolve lets the converter fold: 256 << N, 256 >> N,
+# M / -1 and M % -1.
+def folds():
+    o = Obj()
+    n = o.imp('N'); m = o.imp('M')
+    o.seg('CODE', [('lit', b'\xea'),
+                   ('expr', 4, binary(SHL, lit(0x100), sym(n))), ('expr', 4, binary(SHR, lit(0x100), sym(n))),
+                   ('expr', 4, binary(DIV, sym(m), lit(-1))), ('expr', 4, binary(MOD, sym(m), lit(-1)))])
+    o.export_label('fold', 0, 0)
+    return o.build()
+
+# .procs for --function-segments, one fragment per instruction as ca65
+# writes them.  f2, f4 and f7 may be split off; f3 is the target of f2's beq,
+# f5 follows lda #$60 and f6 follows lda $1280.
+def functions():
+    o = Obj()
+    code = [
+        ('f1', [b'\xa9\x01', b'\x60']),                   # lda #1; rts
+        ('f2', [b'\xf0\x01', b'\x60']),                   # beq f3; rts
+        ('f3', [b'\xea', b'\x60']),                       # nop; rts
+        ('f4', [b'\xa9\x60']),                            # lda #$60
+        ('f5', [b'\xad\x80\x12']),                        # lda $1280
+        ('f6', [b'\x60']),                                # rts
+        ('f7', [b'\xc2\x30', b'\xa9\x34\x12', b'\x6b']),  # rep #$30; lda #$1234; rtl
+    ]
+    frags = []; offset = 0
+    for name, instructions in code:
+        size = sum(len(i) for i in instructions)
+        o.export_label(name, 0, offset)
+        o.proc(name, 0, offset, size)
+        frags += [('lit', i) for i in instructions]; offset += size
+    o.seg('CODE', frags)
+    return o.build()
+
+# self contained segments, identical in every copy (--dedup).
+def helper():
+    o = Obj()
+    ext = o.imp('ext')
+    o.seg('CODE', [('lit', b'\xa9\x01'), ('expr', 2, sym(ext)), ('lit', b'\x60')])
+    o.seg('RODATA', [('lit', b'tbl\0')])
+    o.export_label('helper', 0, 0)
+    o.export_label('htab', 1, 0)
+    return o.build()
+
+# only a constant, for --shared-equates conflicts.
+def constant(name, value):
+    o = Obj()
+    o.export_const(name, value)
+    return o.build()
+
+# each member imports from the one before it.
+def chain(n):
+    members = []
+    for i in range(n):
+        o = Obj()
+        frags = [('lit', b'\x60')]
+        if i: frags.append(('expr', 2, sym(o.imp('c%d' % (i - 1)))))
+        o.seg('CODE', frags)
+        o.export_label('c%d' % i, 0, 0)
+        members.append(('c%d.o' % i, o.build()))
+    return library(members)
+
+def write(dir, name, data):
+    with open(os.path.join(dir, name), 'wb') as f: f.write(data)
+
+if __name__ == '__main__':
+    dir = sys.argv[1]
+    objects = {
+        'a.o': sample('a_', ('b_start', 'ext')),
+        'b.o': sample('b_', ('c_start', 'a_msg')),
+        'c.o': sample('c_', ('b_second', 'a_start')),
+        'd.o': sample('d_', ('ext2',)),
+        'r.o': romcall(),
+        'fold.o': folds(),
+        'f.o': functions(),
+        'h1.o': helper(),
+        'h2.o': helper(),
+        'k.o': constant('a_CONST', 0x5678),
+    }
+    for name, data in objects.items(): write(dir, name, data)
+    write(dir, 'x.lib', library([(n, objects[n]) for n in ('a.o', 'b.o', 'c.o', 'd.o')]))
+    write(dir, 'dd.lib', library([(n, objects[n]) for n in ('h1.o', 'a.o', 'h2.o')]))
+    write(dir, 'k.lib', library([(n, objects[n]) for n in ('a.o', 'k.o')]))
+    write(dir, 'chain.lib', chain(4))
@@ -0,0 +1,72 @@
+# prints the segments of OMF objects and libraries, one line per segment,
+# library file and dictionary entry, for tests/run.sh to grep.
+#
+#   python3 omf.py file...
+#
+#   seg NAME kind=$xxxx length=n
+#   file NUMBER NAME
+#   sym NAME file=n private=n segment=NAME
+#   global NAME          (GLOBAL records of the segment above)
+#   gequ NAME
+
+import struct, sys
+
+def pstring(b, i):
+    n = b[i]; return b[i + 1:i + 1 + n].decode(), i + 1 + n
+
+def expression(b, i):
+    while True:
+        op = b[i]; i += 1
+        if op == 0: return i
+        if op in (0x81, 0x87): i += 4
+        elif op in (0x82, 0x83, 0x84, 0x85, 0x86): _, i = pstring(b, i)
+
+def body(b, i, end):
+    while i < end:
+        op = b[i]; i += 1
+        if op == 0: return
+        if op <= 0xdf: i += op
+        elif op in (0xe0, 0xe1, 0xf1): i += 4
+        elif op == 0xf2: n, = struct.unpack_from('<I', b, i); i += 4 + n
+        elif op in (0xeb, 0xec, 0xed, 0xf3): i = expression(b, i + 1)
+        elif op == 0xee: i = expression(b, i + 5)
+        elif op in (0xe4, 0xe5): _, i = pstring(b, i)
+        elif op in (0xe6, 0xef):
+            name, i = pstring(b, i); i += 4
+            if op == 0xe6: print('global', name)
+        elif op in (0xe7, 0xf0):
+            name, i = pstring(b, i); i = expression(b, i + 4)
+            if op == 0xe7: print('gequ', name)
+        else: raise ValueError('record $%02x' % op)
+
+def dump(path):
+    b = open(path, 'rb').read(); i = 0
+    names = {}
+    dictionary = []
+    while i < len(b):
+        count, = struct.unpack_from('<I', b, i)
+        length, = struct.unpack_from('<I', b, i + 8)
+        kind, = struct.unpack_from('<H', b, i + 20)
+        dispname, dispdata = struct.unpack_from('<HH', b, i + 40)
+        name, _ = pstring(b, i + dispname + 10)
+        names[i] = name
+        print('seg %s kind=$%04x length=%d' % (name, kind, length))
+        if kind & 0x1f == 0x08:
+            j = i + dispdata; lconst = []
+            for k in range(3):
+                n, = struct.unpack_from('<I', b, j + 1); lconst.append(b[j + 5:j + 5 + n]); j += 5 + n
+            files, symbols, strings = lconst
+            k = 0
+            while k < len(files):
+                number, = struct.unpack_from('<H', files, k); s, k = pstring(files, k + 2)
+                print('file', number, s)
+            for k in range(0, len(symbols), 12):
+                offset, number, private, address = struct.unpack_from('<IHHI', symbols, k)
+                dictionary.append((pstring(strings, offset)[0], number, private, address))
+        else:
+            body(b, i + dispdata, i + count)
+        i += count
+    for name, number, private, address in dictionary:
+        print('sym %s file=%d private=%d segment=%s' % (name, number, private, names.get(address, '?')))
+
+for path in sys.argv[1:]: dump(path)
@@ -0,0 +1,323 @@
+#!/bin/sh
+# converts the cc65 objects and libraries tests/objects.py writes and
+# checks the results.
+#
+#   sh tests/run.sh ./cc65-to-omf
+
+BIN=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+TESTS=$(cd "$(dirname "$0")" && pwd)
+DIR=$(mktemp -d)
+SERVER=
+WATCH=
+trap '[ -n "$SERVER" ] && kill $SERVER; [ -n "$WATCH" ] && kill $WATCH; rm -rf "$DIR"' EXIT
+
+failed=0
+pass() { echo "ok   $1"; }
+fail() { echo "FAIL $1"; failed=1; }
+
+# check name command...
+check() {
+	name=$1; shift
+	if "$@" >"$DIR/log" 2>&1; then pass "$name"; else fail "$name"; cat "$DIR/log"; fi
+}
+
+# refuse name command... -- the command must fail.
+refuse() {
+	name=$1; shift
+	if "$@" >"$DIR/log" 2>&1; then fail "$name"; else pass "$name"; fi
+}
+
+# output name command... -- the command must succeed and print pattern.
+output() {
+	name=$1; pattern=$2; shift 2
+	if "$@" >"$DIR/log" 2>&1 && grep -q -e "$pattern" "$DIR/log"; then pass "$name"
+	else fail "$name"; cat "$DIR/log"; fi
+}
+
+# wait_for file -- up to 10 seconds.
+wait_for() {
+	for i in 1 2 3 4 5 6 7 8 9 10; do [ -e "$1" ] && return 0; sleep 1; done
+	return 1
+}
+
+cd "$DIR" || exit 1
+python3 "$TESTS/objects.py" . || exit 1
+
+check "convert object" "$BIN" -o a.omf a.o
+check "convert library" "$BIN" -o x.omflib x.lib
+
+# -u: the digest covers the options that change the output, including
+# what --resolve reads, but not -v.
+check "-u" "$BIN" -u -o au.omf a.o
+check "-u output" cmp a.omf au.omf
+output "-u up to date with -v" "au.omf is up to date" "$BIN" -v -u -o au.omf a.o
+check "-u other options" "$BIN" -u --merge-segments -o au.omf a.o
+check "merged" "$BIN" --merge-segments -o am.omf a.o
+check "-u other options reconverted" cmp am.omf au.omf
+echo 'ROMCALL = $1234' >syms
+check "-u --resolve" "$BIN" -u --resolve syms -o ru.omf r.o
+echo 'ROMCALL = $5678' >syms
+check "-u --resolve changed" "$BIN" -u --resolve syms -o ru.omf r.o
+check "--resolve" "$BIN" --resolve syms -o r.omf r.o
+check "-u --resolve reconverted" cmp r.omf ru.omf
+
+# -MD/-MF: the options' files are prerequisites too.
+check "-MD" "$BIN" -MD -o md.omf a.o
+output "-MD depfile" "^md.omf:" cat md.d
+output "-MD input" "^  a.o" cat md.d
+check "-MF --resolve" "$BIN" -MF r.dep --resolve syms -o r.omf r.o
+output "-MF --resolve depfile" "^  syms" cat r.dep
+echo a_start >roots
+check "-MD --roots @file" "$BIN" -MD --roots @roots -o xr.omflib x.lib
+output "-MD --roots depfile" "^  roots" cat xr.d
+
+# --server: requests run in the server, one at a time; a client that finds
+# it busy converts locally.
+"$BIN" --server "$DIR/s.sock" &
+SERVER=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do [ -S s.sock ] && break; sleep 1; done
+check "server" env CC65_TO_OMF_SOCKET="$DIR/s.sock" "$BIN" -o sa.omf a.o
+check "server output" cmp a.omf sa.omf
+check "server library" env CC65_TO_OMF_SOCKET="$DIR/s.sock" "$BIN" -o sx.omflib x.lib
+check "server library output" cmp x.omflib sx.omflib
+check "server library cached" env CC65_TO_OMF_SOCKET="$DIR/s.sock" "$BIN" -o sx.omflib x.lib
+check "server library cached output" cmp x.omflib sx.omflib
+refuse "server error" env CC65_TO_OMF_SOCKET="$DIR/s.sock" "$BIN" -o bad.omf missing.o
+# a client that never sends its request keeps the server busy.
+python3 -c "import socket, time; s = socket.socket(socket.AF_UNIX); s.connect('$DIR/s.sock'); time.sleep(5)" &
+STUCK=$!
+sleep 1
+check "server busy" env CC65_TO_OMF_SOCKET="$DIR/s.sock" "$BIN" -o sb.omf a.o
+check "server busy output" cmp a.omf sb.omf
+check "server busy didn't wait" kill -0 $STUCK
+wait $STUCK
+check "server still running" kill -0 $SERVER
+check "server after busy" env CC65_TO_OMF_SOCKET="$DIR/s.sock" "$BIN" -o sc.omf a.o
+check "server after busy output" cmp a.omf sc.omf
+
+# --list-symbols reads objects and library members without converting.
+output "list symbols import" "^U b_start" "$BIN" --list-symbols a.o
+output "list symbols export" "^T a_second" "$BIN" --list-symbols a.o
+output "list symbols constant" "^A a_CONST" "$BIN" --list-symbols a.o
+output "list symbols library" "^x.lib(d.o):" "$BIN" --list-symbols x.lib
+output "list symbols json" '"name": "a_alias", "type": "I"' "$BIN" --list-symbols=json a.o
+check "list symbols json parses" sh -c "'$BIN' --list-symbols=json a.o x.lib | python3 -c 'import json, sys; json.load(sys.stdin)'"
+
+# --symbol-index writes lib.idx; --find binary searches it in place.
+check "symbol index" "$BIN" --symbol-index -o xi.omflib x.lib
+check "symbol index written" test -f xi.omflib.idx
+output "find" "^a_second: xi.omflib(a.o) file 1, segment 1 CODE+\$0004" "$BIN" --find a_second xi.omflib
+output "find .idx" "^d_msg: xi.omflib(d.o) file 4" "$BIN" --find d_msg xi.omflib.idx
+refuse "find missing" "$BIN" --find nothing xi.omflib
+python3 - <<'EOF2'
+data = open('xi.omflib.idx', 'rb').read()
+open('cut.omflib.idx', 'wb').write(data[:-3])
+d = bytearray(data)
+for i in range(int.from_bytes(data[8:12], 'little')):
+    d[16 + 20 * i + 4:16 + 20 * i + 8] = b'\xf0\xff\xff\x7f'
+open('bad.omflib.idx', 'wb').write(d)
+EOF2
+output "find truncated index" "corrupt symbol index" sh -c "'$BIN' --find d_start --find a_start cut.omflib; true"
+output "find corrupt index" "corrupt symbol index" sh -c "'$BIN' --find d_start --find a_start bad.omflib; true"
+
+# --sort-dictionary: dictionary entries and names in name order.
+symbols() { python3 "$TESTS/omf.py" "$1" | sed -n 's/^sym \([^ ]*\).*/\1/p'; }
+check "sort dictionary" "$BIN" --sort-dictionary -o xs.omflib x.lib
+symbols xs.omflib >xs.txt
+symbols x.omflib >x.txt
+check "dictionary sorted" env LC_ALL=C sort -c xs.txt
+refuse "dictionary unsorted by default" env LC_ALL=C sort -c x.txt
+check "dictionary entries kept" sh -c "LC_ALL=C sort x.txt | cmp - xs.txt"
+check "sorted library read" "$BIN" --library --sort-dictionary -o xs2.omflib xs.omflib
+check "sorted library round trip" cmp xs.omflib xs2.omflib
+
+# --order-members: importers before exporters; cycles (a, b, c) together.
+check "order members" "$BIN" --order-members -o co.omflib chain.lib
+output "order members first" "^file 1 c3.o" python3 "$TESTS/omf.py" co.omflib
+output "order members last" "^file 4 c0.o" python3 "$TESTS/omf.py" co.omflib
+check "order members cycle" "$BIN" --order-members -o xo.omflib x.lib
+output "order members cycle together" "^file 4 c.o" python3 "$TESTS/omf.py" xo.omflib
+refuse "order members sort dictionary" "$BIN" --order-members --sort-dictionary -o co.omflib chain.lib
+check "dependency graph" "$BIN" --dependency-graph g.dot -o cg.omflib chain.lib
+output "dependency graph edge" 'm2 -> m1 \[label="c0", color=red\]' cat g.dot
+check "dependency graph json" "$BIN" --dependency-graph g.json -o xg.omflib x.lib
+output "dependency graph cycle" '"cycles": \[' cat g.json
+check "dependency graph json parses" python3 -c "import json; json.load(open('g.json'))"
+
+# --roots keeps the members the roots need, transitively.
+output "roots" "^2 of 4 members dropped" "$BIN" --roots c1 -o cr.omflib chain.lib
+output "roots members" "^file 2 c1.o" python3 "$TESTS/omf.py" cr.omflib
+output "roots -v" "^dropped c3.o" "$BIN" -v --roots c2 -o cr.omflib chain.lib
+echo "c3, c0" >roots.txt
+output "roots @file" "^0 of 4 members dropped" "$BIN" --roots @roots.txt -o cr.omflib chain.lib
+
+# --function-segments: only at .procs nothing falls through into or
+# branches across.
+output "function segments" "not split at f3 (a branch crosses it)" "$BIN" --function-segments -o f.omf f.o
+python3 "$TESTS/omf.py" f.omf >f.txt
+piece() { sed -n "/^seg $1 /,/^seg/s/^global //p" f.txt | tr '\n' ' '; }
+check "function segments split" test "$(piece CODE)" = "f1 "
+check "function segments branch" test "$(piece CODE~1)" = "f2 f3 "
+check "function segments fall through" test "$(piece CODE~2)" = "f4 f5 f6 "
+check "function segments rtl" test "$(piece CODE~3)" = "f7 "
+output "function segments without scopes" "no .proc scopes" "$BIN" --function-segments -o af.omf a.o
+check "function segments without scopes output" cmp a.omf af.omf
+
+# --merge-segments: CODE, RODATA and BSS become one segment.
+check "merge segments" "$BIN" --merge-segments -o am.omf a.o
+output "merge segments one" "^seg CODE kind=\$4000 length=37" python3 "$TESTS/omf.py" am.omf
+refuse "merge segments others" sh -c "python3 '$TESTS/omf.py' am.omf | grep -q -e '^seg RODATA' -e '^seg BSS'"
+output "merge segments exports" "^global a_msg" python3 "$TESTS/omf.py" am.omf
+refuse "merge segments function segments" "$BIN" --merge-segments --function-segments -o am.omf a.o
+
+# --dedup drops h2.o's copies of h1.o's segments.
+output "dedup" "^2 duplicate segments removed" "$BIN" --dedup --symbol-index -o dd.omflib dd.lib
+python3 "$TESTS/omf.py" dd.omflib >dd.txt
+check "dedup segments" test "$(grep -c '^seg' dd.txt)" = 7
+refuse "dedup dictionary" grep -q "^sym helper file=3" dd.txt
+output "dedup find" "^helper: dd.omflib(h1.o)" "$BIN" --find helper dd.omflib
+
+# --shared-equates: the constants of every member in one EQUATES member;
+# the first value wins.
+output "shared equates" "^4 equates (4 unique, 0 conflicting) in member EQUATES" "$BIN" --shared-equates -o xq.omflib x.lib
+python3 "$TESTS/omf.py" xq.omflib >xq.txt
+check "shared equates member" grep -q "^file 5 EQUATES" xq.txt
+check "shared equates dictionary" grep -q "^sym d_CONST file=5 " xq.txt
+output "shared equates conflict" "a_CONST = \$5678 conflicts with \$1234 in a.o" "$BIN" --shared-equates -o kq.omflib k.lib
+
+# --check links without linking: objects always, library members as needed.
+check "check" "$BIN" --check f.o
+refuse "check undefined" "$BIN" --check c.o x.lib
+output "check members linked" "^1 object, 2 library members linked" sh -c "'$BIN' --check c.o x.lib; true"
+output "check undefined member" "^undefined: ext (referenced by x.lib(a.o))" sh -c "'$BIN' --check c.o x.lib; true"
+output "check -v" "^a_start: x.lib(a.o)" sh -c "'$BIN' -v --check c.o x.lib; true"
+output "check duplicate" "^duplicate: helper in h1.o h2.o" sh -c "'$BIN' --check h1.o h2.o; true"
+
+# --resolve: resolved imports become constants, and the expressions they
+# are in are folded with ca65's semantics.
+check "resolve" "$BIN" --resolve syms -o r.omf r.o
+refuse "resolve import" grep -q ROMCALL r.omf
+check "resolve unresolved" "$BIN" -o r.omf r.o
+check "resolve unresolved import" grep -q ROMCALL r.omf
+contains() { python3 -c "import sys; sys.exit(bytes.fromhex('$2') not in open('$1', 'rb').read())"; }
+printf 'N = 40\nM = $80000000\n' >fold.syms
+check "fold" "$BIN" --resolve fold.syms -o fold.omf fold.o
+check "fold shift out" contains fold.omf ea0000000000000000
+printf 'N = $fffffffc\nM = $80000000\n' >fold.syms
+check "fold negative shift" "$BIN" --resolve fold.syms -o fold.omf fold.o
+check "fold negative shift output" contains fold.omf ea1000000000100000
+refuse "resolve bad value" "$BIN" --resolve fold.o -o fold.omf fold.o
+
+# batch: more than one input, converted in parallel into the -o directory;
+# -v and errors in input order.
+mkdir batch batch_in
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+	cp a.o batch_in/a$i.o
+	cp x.lib batch_in/x$i.lib
+done
+check "batch" "$BIN" -o batch batch_in/*
+same=0
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+	cmp -s a.omf batch/a$i.omf && cmp -s x.omflib batch/x$i.omflib || same=1
+done
+check "batch outputs" test $same = 0
+"$BIN" -v -o batch d.o c.o b.o a.o >batch.log 2>&1
+printf 'd.o -> batch/d.omf\nc.o -> batch/c.omf\nb.o -> batch/b.omf\na.o -> batch/a.omf\n' >batch.txt
+check "batch order" cmp batch.txt batch.log
+head -c 2 a.o >short.o
+refuse "batch skips" "$BIN" -o batch short.o r.o
+check "batch skips others converted" cmp r.omf batch/r.omf
+refuse "batch missing" "$BIN" -o batch a.o missing.o
+check "batch -u" "$BIN" -u -o batch a.o x.lib
+output "batch -u up to date" "^batch/x.omflib is up to date" "$BIN" -v -u -o batch a.o x.lib
+
+# --split writes each member as an object, not a library.
+mkdir split
+check "split" "$BIN" --split split x.lib
+check "split objects" test -f split/a.omf -a -f split/b.omf -a -f split/c.omf -a -f split/d.omf
+check "split object output" cmp a.omf split/a.omf
+refuse "split dedup" "$BIN" --split split --dedup x.lib
+refuse "split -u" "$BIN" -u --split split x.lib
+refuse "split symbol index" "$BIN" --split split --symbol-index x.lib
+
+# --library: one library from objects and libraries; conflicting exports
+# are reported and the first definition wins.
+check "library" "$BIN" --library -o l.omflib a.o b.o c.o d.o
+check "library output" cmp x.omflib l.omflib
+check "library mixed" "$BIN" --library -o lr.omflib x.lib r.o
+output "library mixed members" "^file 5 r.o" python3 "$TESTS/omf.py" lr.omflib
+output "library conflicts" "^2 conflicting symbols" "$BIN" --library -o lh.omflib h1.o h2.o
+output "library conflict first" "^sym helper file=1 " python3 "$TESTS/omf.py" lh.omflib
+refuse "library -u" "$BIN" -u --library -o l.omflib a.o
+
+# OMF libraries as --library inputs: read back exactly, renumbered when
+# merged.
+check "omf library read" "$BIN" --library -o x2.omflib x.omflib
+check "omf library round trip" cmp x.omflib x2.omflib
+check "omf library dedup read" "$BIN" --dedup --library -o dd2.omflib dd.omflib
+check "omf library dedup round trip" cmp dd.omflib dd2.omflib
+check "omf library merge" "$BIN" --library -o xc.omflib x.omflib chain.lib
+output "omf library merge renumbered" "^sym c0 file=5 " python3 "$TESTS/omf.py" xc.omflib
+output "omf library merge conflicts" "a_start: exported by x.omflib(a.o) and x.lib(a.o)" "$BIN" --library -o xx.omflib x.omflib x.lib
+# fixed length labels can't be read; orgs and alignment aren't kept.
+python3 - <<'EOF2'
+data = open('x.omflib', 'rb').read()
+member = int.from_bytes(data[0:4], 'little')
+for name, offset, value in (('lablen.omflib', 13, 10), ('org.omflib', 24, 1)):
+    d = bytearray(data); d[member + offset] = value
+    open(name, 'wb').write(d)
+EOF2
+refuse "omf library fixed length labels" "$BIN" --library -o bad.omflib lablen.omflib
+output "omf library org" "org and alignment are not preserved" "$BIN" --library -o org2.omflib org.omflib
+
+# --max-members, --max-lib-size: importers first, so each part only needs
+# the later ones; mutually dependent members stay together.
+check "max members" sh -c "'$BIN' -v --max-members 1 -o p.omflib chain.lib >parts.txt"
+check "max members parts in order" grep -q "c1.o (library 3) imports c0 from c0.o (library 4)" parts.txt
+output "max members first part" "^file 1 c3.o" python3 "$TESTS/omf.py" p1.omflib
+for i in 1 2 3 4; do
+	check "max members part $i round trip" sh -c "'$BIN' --library -o q.omflib p$i.omflib && cmp p$i.omflib q.omflib"
+done
+refuse "max members suffix" "$BIN" --max-members 1k -o p.omflib chain.lib
+output "max lib size cycle" "3 mutually dependent members (a.o, ...) exceed the library limit" "$BIN" --max-lib-size 1k -o s.omflib x.lib
+check "max lib size parts" test -f s1.omflib -a -f s2.omflib -a ! -f s3.omflib
+output "max lib size last part" "^file 1 d.o" python3 "$TESTS/omf.py" s2.omflib
+
+# --update replaces or adds members without converting the others.
+cp x.omflib u.omflib
+check "update replace" "$BIN" --update u.omflib a.o
+check "update replace round trip" cmp x.omflib u.omflib
+check "update add" "$BIN" --update u.omflib r.o
+check "library with r.o" "$BIN" --library -o xr2.omflib x.lib r.o
+check "update add round trip" cmp xr2.omflib u.omflib
+refuse "update same input twice" "$BIN" --update u.omflib a.o a.o
+cp dd.omflib du.omflib
+check "dedup update" "$BIN" --dedup --update du.omflib h2.o
+check "dedup update round trip" cmp dd.omflib du.omflib
+refuse "update org" "$BIN" -o bad.omflib --update org.omflib a.o
+refuse "update fixed length labels" "$BIN" -o bad.omflib --update lablen.omflib a.o
+# an EQUATES member would be added again rather than updated.
+refuse "update shared equates" "$BIN" --shared-equates --update u.omflib a.o
+refuse "library shared equates omf" "$BIN" --shared-equates --library -o bad.omflib xq.omflib a.o
+check "library shared equates omf without equates" "$BIN" --shared-equates --library -o xq2.omflib x.omflib r.o
+
+# --watch (inotify): existing inputs are converted, then new ones; a bad
+# input is skipped without ending the watch.
+if [ "$(uname)" = Linux ]; then
+	mkdir watched watch_out
+	cp a.o watched/
+	"$BIN" --watch -o watch_out watched >watch.log 2>&1 &
+	WATCH=$!
+	check "watch existing" wait_for watch_out/a.omf
+	head -c 100 a.o >watched/bad.o
+	cp x.lib watched/
+	check "watch new" wait_for watch_out/x.omflib
+	sleep 1
+	check "watch output" cmp x.omflib watch_out/x.omflib
+	check "watch bad input" grep -q "bad.o not converted" watch.log
+	check "watch still running" kill -0 $WATCH
+	cp r.o watched/
+	check "watch after bad input" wait_for watch_out/r.omf
+fi
+
+exit $failed
@@ -1,13 +1,63 @@
 #ifndef CC65_TO_OMF
 #define CC65_TO_OMF
 
+#include <exception>
+#include <memory_resource>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include <stdint.h>
 #include <stdio.h>
 
-inline void push_back_string(std::vector<uint8_t> &data, const std::string &s) {
-	if (s.size() > 0xff) errx(1, "symbol too big: %s", s.c_str());
+// like err() and errx().  When errors are recoverable (--watch, --server),
+// the message is printed and fatal_error is thrown instead of exiting.
+struct fatal_error {
+	int status;
+};
+
+extern bool flag_recover;
+[[noreturn]] void fatal_exit(int status);
+[[noreturn]] void fatal(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+[[noreturn]] void fatalx(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// calls fn(), closing f if a fatal_error interrupts it.
+template<class F>
+void close_on_error(FILE *f, F &&fn) {
+	try {
+		fn();
+	} catch (const fatal_error &) {
+		fclose(f);
+		throw;
+	}
+}
+
+// a fatal_error on a worker thread is rethrown by the thread that started
+// it, once they've all been joined.
+class worker_errors {
+public:
+	template<class F>
+	void run(F &&f) {
+		try {
+			f();
+		} catch (const fatal_error &) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error) error = std::current_exception();
+		}
+	}
+
+	void rethrow() {
+		if (error) std::rethrow_exception(error);
+	}
+
+private:
+	std::mutex mutex;
+	std::exception_ptr error;
+};
+
+inline void push_back_string(std::vector<uint8_t> &data, std::string_view s) {
+	if (s.size() > 0xff) fatalx("symbol too big: %.*s", (int)s.size(), s.data());
 	data.push_back(s.size());
 	data.insert(data.end(), s.begin(), s.end());
 }
@@ -43,44 +93,176 @@ struct expr_node {
 
 };
 
-typedef std::vector<expr_node> expr_vector;
+// fragment expressions are allocated from MemberArena (see read_expr).
+// default constructed vectors use the heap.
+typedef std::pmr::vector<expr_node> expr_vector;
 
 
+// interned names -- stored once per run, equal names have the same address.
+std::string_view intern(std::string_view s);
+
 // "export" is reserved word in C++....
 struct export_sym {
-	std::string name;
+	std::string_view name;
 
 	expr_vector expr;
 	bool sectional = false;
 	int section = 0;
 	uint32_t offset = 0;
+	bool priv = false; // private dictionary entry (OMF libraries)
 };
 
 struct segment {
-	std::string name;
+	std::string_view name;
 	long size = 0;
 	long address = 0;
 	unsigned omf_kind = 0;
 	std::vector<uint8_t> omf;
 	std::vector<export_sym> exports;
+	std::vector<uint32_t> splits; // --function-segments piece offsets
+	int merged = -1; // --merge-segments target segment
+	uint32_t base = 0; // offset in the target segment
+	bool section_labels = false; // refers to other segments by name
+};
+
+struct lib_member {
+	std::string name;
+	unsigned flags = 0;
+	unsigned long mtime = 0;
+	unsigned long offset = 0;
+	unsigned long size = 0;
+};
+
+struct ObjHeader;
+int file_type(FILE *f);
+void read_obj_header(FILE *f, ObjHeader &h);
+void read_lib_index(FILE *f, std::vector<lib_member> &members);
+void skip_info_list(FILE *f);
+
+// symbol listing.
+struct symbol_export {
+	std::string name;
+	char type = 'A'; // nm-style: T (section relative), A (absolute), I (import expression)
+};
+
+struct object_symbols {
+	std::string file;
+	std::string member;
+	std::vector<std::string> imports;
+	std::vector<symbol_export> exports;
+};
+
+void read_object_symbols(FILE *f, object_symbols &os);
+void read_file_symbols(const std::string &path, std::vector<object_symbols> &rv);
+int list_symbols(int argc, char **argv, bool json);
+int check_symbols(int argc, char **argv);
+
+// library symbol index.
+struct index_entry {
+	std::string name;
+	std::string member;
+	std::string segment;
+	uint32_t offset = 0;
+	uint16_t file = 0;
+	uint16_t segno = 0;
 };
 
-extern std::vector<std::string> StringPool;
-extern std::vector<std::string> Imports;
-extern std::vector<segment> Segments;
+void write_symbol_index(const std::string &path, std::vector<index_entry> &entries);
+int find_symbols(const std::vector<std::string> &symbols, int argc, char **argv);
+
+// a converted object (library member).
+struct file {
+	unsigned number = 0;
+	std::string name;
+	std::vector<std::string_view> imports;
+	std::vector<segment> segments;
+	std::vector<export_sym> equates; // --shared-equates
+};
+
+// library member dependencies.
+struct member_edge {
+	unsigned to = 0;
+	std::vector<std::string_view> symbols;
+};
+
+typedef std::vector<std::vector<member_edge>> member_graph;
+
+void build_member_graph(const std::vector<file> &files, member_graph &graph);
+std::vector<std::vector<unsigned>> strongly_connected(const member_graph &graph);
+void order_members(std::vector<file> &files);
+void shake_members(std::vector<file> &files, const std::vector<std::string> &roots);
+unsigned long member_size(const file &f);
+std::vector<std::vector<file>> partition_members(std::vector<file> &files, unsigned max_members, unsigned long max_size);
+void write_member_graph(const std::string &path, const std::vector<file> &files);
 
+// the object being converted.  Each thread converts its own (--split).
+// per-member scratch memory, rewound by reset().
+extern thread_local std::pmr::monotonic_buffer_resource MemberArena;
 
+extern thread_local std::pmr::vector<std::string_view> StringPool;
+extern thread_local std::pmr::vector<std::string_view> Imports;
+extern thread_local std::vector<segment> Segments;
+extern thread_local std::vector<export_sym> Equates;
+void reset();
+extern std::unordered_map<const char *, uint32_t> Constants;
+
+
+
+// the object an expression belongs to.  Segments and Imports are per
+// thread, so segment workers are handed their converting thread's.
+struct object_ref {
+	const std::vector<segment> &segments;
+	const std::pmr::vector<std::string_view> &imports;
+};
 
 // void export_expr(FILE *f, unsigned &section, long &offset);
-void convert_expression(const expr_vector &, unsigned size, std::vector<uint8_t> &omf, unsigned section);
+bool convert_expression(const object_ref &obj, const expr_vector &, unsigned size, std::vector<uint8_t> &omf, unsigned section, unsigned piece = 0);
+std::string_view piece_name(const segment &seg, unsigned piece);
 bool section_expr(const expr_vector &ev, int &section, uint32_t &offset);
 
-void convert_gequ(const std::string &name, const expr_vector &ev, std::vector<uint8_t> &omf);
+void convert_gequ(std::string_view name, const expr_vector &ev, std::vector<uint8_t> &omf);
 
 
 expr_vector read_expr(FILE *f);
 
 int set_prodos_file_type(const std::string &path, uint16_t fileType, uint32_t auxType);
+int set_digest_info(const std::string &path, const std::vector<uint8_t> &data);
+int get_digest_info(const std::string &path, std::vector<uint8_t> &data);
+
+uint64_t options_digest(const std::string &options);
+bool up_to_date(const std::string &infile, const std::string &outfile, uint64_t options);
+void save_digest(const std::string &infile, const std::string &outfile, uint64_t options);
+
+uint64_t hash_data(const void *data, size_t size);
+
+extern bool in_server;
+extern bool flag_cache;
+void save_options();
+void restore_options();
+int cc65_to_omf(int argc, char **argv);
+int run_server(const char *path);
+int run_client(const char *path, const std::vector<std::string> &args);
+
+extern bool flag_v;
+extern bool flag_u;
+extern bool flag_md;
+extern thread_local std::vector<std::string> Outputs;
+int file_type(const std::string &path);
+std::string output_name(const std::string &path, int type, const char *dir);
+void convert_file(FILE *f, const std::string &in, const std::string &out);
+void convert_file(const std::string &in, const std::string &out);
+int run_watch(int argc, char **argv, const char *outdir);
+
+void write_depfile(const std::string &path, const std::vector<std::string> &inputs);
+std::string default_depfile(const std::string &path);
+
+void write_output(const std::string &path, std::vector<uint8_t> &&data, uint16_t file_type);
+int run_batch(int argc, char **argv, const char *outdir, uint64_t options);
+
+bool is_omf_library(FILE *f);
+void read_omf_library(const std::string &path, std::vector<file> &files, bool exact = false);
+long save_omf_segment(std::vector<uint8_t> &data, const segment &seg, int segno);
+void omf_references(const segment &seg, std::vector<std::string_view> &names);
 
 
 // #define EXPR_SECTION_REL 0x87
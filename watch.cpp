@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <err.h>
+
+#include "libdefs.h"
+#include "objdefs.h"
+
+#include "to_omf.h"
+
+/*
+
+Watch mode.
+
+--watch dir... converts cc65 objects (.o) and libraries (.lib) in each
+directory as they are written.  Writes are debounced so a burst from ar65
+results in a single conversion.  Library members that haven't changed
+since the last conversion are reused from the member cache.
+
+*/
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+namespace {
+
+	typedef std::chrono::steady_clock watch_clock;
+
+	// quiet period before converting.
+	const int debounce_ms = 50;
+
+	bool is_input(const std::string &name) {
+		auto dot = name.rfind('.');
+		if (dot == name.npos) return false;
+		auto ext = name.substr(dot);
+		return ext == ".o" || ext == ".lib";
+	}
+
+	// -1 if not a cc65 object or library (yet).
+	int input_type(const std::string &path) {
+		uint8_t magic[4];
+
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f) return -1;
+		size_t n = fread(magic, 1, 4, f);
+		fclose(f);
+		if (n != 4) return -1;
+
+		uint32_t x = magic[0] | (magic[1] << 8) | (magic[2] << 16) | ((uint32_t)magic[3] << 24);
+		if (x == OBJ_MAGIC) return 0;
+		if (x == LIB_MAGIC) return 1;
+		return -1;
+	}
+
+	bool newer(const std::string &a, const std::string &b) {
+		struct stat sa, sb;
+		if (stat(a.c_str(), &sa) < 0) return false;
+		if (stat(b.c_str(), &sb) < 0) return true;
+		return sa.st_mtime > sb.st_mtime;
+	}
+
+	void convert(const std::string &path, const char *outdir, watch_clock::time_point event) {
+
+		auto start = watch_clock::now();
+
+		int type = input_type(path);
+		if (type < 0) {
+			warnx("Skipping %s: not a cc65 object or library", path.c_str());
+			return;
+		}
+
+		std::string out = output_name(path, type, outdir);
+
+		// a bad (or half written) input shouldn't end the watch.
+		Outputs.clear();
+		try {
+			convert_file(path, out);
+		} catch (const fatal_error &) {
+			warnx("%s not converted", path.c_str());
+			fflush(stderr);
+			return;
+		}
+
+		auto end = watch_clock::now();
+
+		auto ms = [](watch_clock::duration d) {
+			return (long)std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+		};
+
+		printf("%s -> %s (%ld ms, %ld ms after change)\n",
+			path.c_str(), out.c_str(), ms(end - start), ms(end - event));
+		fflush(stdout);
+	}
+
+	// initial pass -- anything with a missing or stale output.
+	void scan(const std::string &dir, const char *outdir) {
+
+		std::vector<std::string> names;
+
+		DIR *dp = opendir(dir.c_str());
+		if (!dp) err(1, "Unable to open directory %s", dir.c_str());
+		while (struct dirent *d = readdir(dp)) {
+			std::string name = d->d_name;
+			if (is_input(name)) names.emplace_back(dir + "/" + name);
+		}
+		closedir(dp);
+
+		std::sort(names.begin(), names.end());
+		for (const auto &path : names) {
+			int type = input_type(path);
+			if (type < 0) continue;
+			if (newer(path, output_name(path, type, outdir)))
+				convert(path, outdir, watch_clock::now());
+		}
+	}
+}
+
+int run_watch(int argc, char **argv, const char *outdir) {
+
+	std::map<int, std::string> dirs;
+	std::map<std::string, watch_clock::time_point> pending;
+
+	flag_recover = true;
+
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) err(1, "inotify_init");
+
+	for (int i = 0; i < argc; ++i) {
+		std::string dir = argv[i];
+		while (dir.size() > 1 && dir.back() == '/') dir.pop_back();
+
+		int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd < 0) err(1, "Unable to watch %s", dir.c_str());
+		dirs[wd] = dir;
+
+		scan(dir, outdir);
+	}
+
+	if (flag_v) {
+		printf("watching %d director%s\n", argc, argc == 1 ? "y" : "ies");
+		fflush(stdout);
+	}
+
+	alignas(struct inotify_event) char buffer[4096];
+
+	for(;;) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+
+		int rv = poll(&pfd, 1, pending.empty() ? -1 : debounce_ms);
+		if (rv < 0) {
+			if (errno == EINTR) continue;
+			err(1, "poll");
+		}
+
+		if (rv == 0) {
+			// quiet -- convert everything pending.
+			for (const auto &kv : pending) {
+				if (access(kv.first.c_str(), R_OK) < 0) continue;
+				convert(kv.first, outdir, kv.second);
+			}
+			pending.clear();
+			continue;
+		}
+
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			err(1, "read");
+		}
+
+		for (char *cp = buffer; cp < buffer + n; ) {
+			auto ev = reinterpret_cast<struct inotify_event *>(cp);
+			cp += sizeof(struct inotify_event) + ev->len;
+
+			if (!ev->len) continue;
+			std::string name = ev->name;
+			if (!is_input(name)) continue;
+
+			auto iter = dirs.find(ev->wd);
+			if (iter == dirs.end()) continue;
+
+			// keep the time of the first event.
+			pending.emplace(iter->second + "/" + name, watch_clock::now());
+		}
+	}
+	return 0;
+}
+
+#else
+
+int run_watch(int argc, char **argv, const char *outdir) {
+	errx(1, "--watch is not supported on this platform.");
+	return 1;
+}
+
+#endif